@@ -0,0 +1,243 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// turtle-bench
+// Runs each workload in a fresh interpreter and reports, as JSON on stdout, the best and
+// mean wall time over the runs, the peak resident set size, the bytes the collector
+// allocated, and the objects counted by a build with TURTLE_STATS (null otherwise). Given a baseline report it prints a
+// comparison on stderr and exits with 1 if any workload got slower by more than the
+// threshold. Workloads default to the .tl files of the bench directory.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+extern char** environ;
+
+typedef struct Result { char name[64]; double wall, mean; long maxrss; int64_t allocs, allocBytes, heapBytes; int status; } Result;
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// read the summary turtle prints at exit with TURTLE_STATS set: the collector's byte count
+// from every build, and the sum of the allocation table from a stats build
+static void parseStats(FILE* f, Result* r)
+{
+  char line[256];
+  uint8_t table = 0;
+  while (fgets(line, sizeof(line), f))
+  {
+    char tag[64];
+    long long count, bytes;
+    if (sscanf(line, "  bytes-allocated %lld", &bytes) == 1) r->heapBytes = bytes;
+    else if (!strncmp(line, "  allocations", 13)) { table = 1; r->allocs = r->allocBytes = 0; }
+    else if (table && sscanf(line, " %63s %lld %lld", tag, &count, &bytes) == 3)
+    {
+      r->allocs += count;
+      r->allocBytes += bytes;
+    }
+  }
+}
+
+// one run of script; returns the wall time, or a negative number if turtle could not start
+static double runOnce(const char* turtle, const uint8_t vm, const char* script, Result* r)
+{
+  FILE* err = tmpfile();
+  if (!err) return -1;
+  char* args[] = {(char*)turtle, vm ? "--vm" : (char*)script, vm ? (char*)script : NULL, NULL};
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, fileno(err), STDERR_FILENO);
+  setenv("TURTLE_STATS", "1", 1);
+  const double start = now();
+  pid_t pid;
+  const int failed = posix_spawn(&pid, turtle, &actions, NULL, args, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (failed)
+  {
+    fclose(err);
+    errno = failed;
+    return -1;
+  }
+  int status;
+  struct rusage ru;
+  while (wait4(pid, &status, 0, &ru) == -1 && errno == EINTR);
+  const double wall = now() - start;
+  r->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  if (ru.ru_maxrss > r->maxrss) r->maxrss = ru.ru_maxrss;
+  rewind(err);
+  parseStats(err, r);
+  fclose(err);
+  return wall;
+}
+
+static int compareNames(const void* a, const void* b) { return strcmp(*(char* const*)a, *(char* const*)b); }
+
+// the .tl files of dir, sorted
+static char** workloads(const char* dir, int* count)
+{
+  DIR* d = opendir(dir);
+  if (!d) return NULL;
+  char** paths = NULL;
+  *count = 0;
+  for (struct dirent* e; (e = readdir(d));)
+  {
+    const size_t n = strlen(e->d_name);
+    if (n < 4 || strcmp(e->d_name + n - 3, ".tl")) continue;
+    paths = realloc(paths, (*count + 1) * sizeof(char*));
+    if (!paths || asprintf(&paths[*count], "%s/%s", dir, e->d_name) == -1) { perror("turtle-bench"); exit(2); }
+    (*count)++;
+  }
+  closedir(d);
+  qsort(paths, *count, sizeof(char*), compareNames);
+  return paths;
+}
+
+static void baseName(const char* path, char* name, const size_t size)
+{
+  const char* slash = strrchr(path, '/');
+  snprintf(name, size, "%s", slash ? slash + 1 : path);
+  char* dot = strrchr(name, '.');
+  if (dot) *dot = '\0';
+}
+
+static void writeReport(FILE* f, const char* turtle, const uint8_t vm, const int runs, const Result* results, const int count)
+{
+  fprintf(f, "{\n  \"turtle\": \"%s\",\n  \"engine\": \"%s\",\n  \"runs\": %d,\n  \"benchmarks\": [\n", turtle, vm ? "vm" : "tree", runs);
+  for (int i = 0; i < count; i++)
+  {
+    const Result* r = &results[i];
+    fprintf(f, "    {\"name\": \"%s\", \"wall\": %.6f, \"wall_mean\": %.6f, \"maxrss_kb\": %ld, ", r->name, r->wall, r->mean, r->maxrss);
+    fprintf(f, "\"heap_bytes\": %lld, ", (long long)r->heapBytes);
+    if (r->allocs >= 0) fprintf(f, "\"allocs\": %lld, \"alloc_bytes\": %lld, ", (long long)r->allocs, (long long)r->allocBytes);
+    else fprintf(f, "\"allocs\": null, \"alloc_bytes\": null, ");
+    fprintf(f, "\"status\": %d}%s\n", r->status, i + 1 < count ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+// compares against a report written by this program, which has one benchmark per line;
+// returns the number of regressions
+static int compare(const char* path, const Result* results, const int count, const double threshold)
+{
+  FILE* f = fopen(path, "r");
+  if (!f) { fprintf(stderr, "turtle-bench: cannot open baseline %s: %s\n", path, strerror(errno)); exit(2); }
+  int regressions = 0;
+  char line[1024];
+  fprintf(stderr, "%-12s %12s %12s %9s\n", "benchmark", "baseline", "wall", "change");
+  while (fgets(line, sizeof(line), f))
+  {
+    char name[64];
+    double wall;
+    const char* at = strstr(line, "{\"name\": \"");
+    if (!at || sscanf(at, "{\"name\": \"%63[^\"]\", \"wall\": %lf", name, &wall) != 2) continue;
+    for (int i = 0; i < count; i++)
+    {
+      if (strcmp(results[i].name, name)) continue;
+      const double change = wall > 0 ? 100 * (results[i].wall - wall) / wall : 0;
+      const uint8_t slower = change > threshold;
+      regressions += slower;
+      fprintf(stderr, "%-12s %12.6f %12.6f %+8.1f%%%s\n", name, wall, results[i].wall, change, slower ? "  REGRESSION" : "");
+    }
+  }
+  fclose(f);
+  return regressions;
+}
+
+int main(int argc, char** argv)
+{
+  const char* turtle = TURTLE_BENCH_TURTLE, * baseline = NULL, * save = NULL;
+  uint8_t vm = 0;
+  int runs = 3;
+  double threshold = 10;
+  char** scripts = NULL;
+  int count = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--vm")) vm = 1;
+    else if (!strcmp(argv[i], "--turtle") && i + 1 < argc) turtle = argv[++i];
+    else if (!strcmp(argv[i], "--runs") && i + 1 < argc) runs = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--baseline") && i + 1 < argc) baseline = argv[++i];
+    else if (!strcmp(argv[i], "--threshold") && i + 1 < argc) threshold = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--save") && i + 1 < argc) save = argv[++i];
+    else if (argv[i][0] != '-')
+    {
+      scripts = realloc(scripts, (count + 1) * sizeof(char*));
+      if (!scripts) { perror("turtle-bench"); return 2; }
+      scripts[count++] = argv[i];
+    }
+    else
+    {
+      fprintf(stderr, "usage: %s [--turtle path] [--vm] [--runs n] [--baseline report] [--threshold percent] [--save report] [script ...]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (runs < 1) runs = 1;
+  if (!count && !(scripts = workloads(TURTLE_BENCH_DIR, &count)))
+  {
+    fprintf(stderr, "turtle-bench: cannot open %s: %s\n", TURTLE_BENCH_DIR, strerror(errno));
+    return 2;
+  }
+
+  Result* results = calloc(count, sizeof(Result));
+  if (!results) { perror("turtle-bench"); return 2; }
+  for (int i = 0; i < count; i++)
+  {
+    Result* r = &results[i];
+    baseName(scripts[i], r->name, sizeof(r->name));
+    r->allocs = r->allocBytes = -1;
+    double total = 0;
+    for (int run = 0; run < runs; run++)
+    {
+      const double wall = runOnce(turtle, vm, scripts[i], r);
+      if (wall < 0) { fprintf(stderr, "turtle-bench: cannot run %s: %s\n", turtle, strerror(errno)); return 2; }
+      if (!run || wall < r->wall) r->wall = wall;
+      total += wall;
+    }
+    r->mean = total / runs;
+    fprintf(stderr, "%-12s %.6f s\n", r->name, r->wall);
+  }
+
+  writeReport(stdout, turtle, vm, runs, results, count);
+  if (save)
+  {
+    FILE* f = fopen(save, "w");
+    if (!f) { fprintf(stderr, "turtle-bench: cannot write %s: %s\n", save, strerror(errno)); return 2; }
+    writeReport(f, turtle, vm, runs, results, count);
+    fclose(f);
+  }
+  return baseline && compare(baseline, results, count, threshold) ? 1 : 0;
+}
@@ -20,34 +20,136 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "turtle.h"
 
+// Symbol table
+// Every symbol is interned in an open addressing table, so each name is allocated once
+// and symbol equality is a pointer compare.
+static char** symbolTable = NULL;
+static uint64_t symbolCount = 0, symbolCapacity = 0;
+static pthread_mutex_t symbolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hashString(const char* str)
+{
+  uint64_t h = 14695981039346656037ULL; // FNV-1a
+  for (; *str; str++) h = (h ^ (uint8_t)*str) * 1099511628211ULL;
+  return h;
+}
+
+static void symbolTableGrow()
+{
+  char** old = symbolTable;
+  const uint64_t oldCapacity = symbolCapacity;
+  symbolCapacity = oldCapacity ? oldCapacity * 2 : 512;
+  symbolTable = objAllocValues(symbolCapacity * sizeof(char*));
+  for (uint64_t i = 0; i < oldCapacity; i++)
+  {
+    if (!old[i]) continue;
+    uint64_t j = hashString(old[i]) & (symbolCapacity - 1);
+    while (symbolTable[j]) j = (j + 1) & (symbolCapacity - 1);
+    symbolTable[j] = old[i];
+  }
+}
+
 char* symbol(char* str)
 {
+  pthread_mutex_lock(&symbolLock);
+  if (2 * (symbolCount + 1) > symbolCapacity) symbolTableGrow();
+  uint64_t i = hashString(str) & (symbolCapacity - 1);
+  for (; symbolTable[i]; i = (i + 1) & (symbolCapacity - 1))
+    if (!strcmp(symbolTable[i], str))
+    {
+      pthread_mutex_unlock(&symbolLock);
+      return symbolTable[i];
+    }
+  
   const size_t len = strlen(str) + 1;
   char* x = (char*)obj(TAG_SYM, len);
   memcpy(x, str, len);
+  symbolTable[i] = x;
+  symbolCount++;
+  pthread_mutex_unlock(&symbolLock);
   return x;
 }
 
-double* number(double n)
+void* number(double n)
 {
+  // integral values are immediate fixnums; -0.0 stays boxed to keep its sign
+  if (n >= -FIXNUM_MAX && n <= FIXNUM_MAX && n == (double)(int64_t)n && (n != 0.0 || !signbit(n)))
+    return (void*)(((uintptr_t)(int64_t)n << 1) | IMM_FIXNUM);
   double* x = (double*)obj(TAG_NUM, sizeof(double));
   *x = n;
   return x;
 }
 
-char* string(char* str)
+double numberValue(const void* const x)
 {
-  const size_t len = strlen(str) + 1;
-  char* x = (char*)obj(TAG_STR, len);
-  memcpy(x, str, len);
+  if ((uintptr_t)x & IMM_FIXNUM) return (double)((intptr_t)x >> 1);
+  return *((const double*)x);
+}
+
+// Strings carry their length. A fresh string keeps its characters inline and
+// NUL-terminated; a slice points into the characters of the string it was cut from.
+String* stringBuffer(const uint64_t length)
+{
+  String* x = (String*)objAtomic(TAG_STR, sizeof(String) + length + 1); // chars points into the string itself
+  x->length = length;
+  x->chars = (char*)(x + 1);
+  x->chars[length] = '\0';
   return x;
 }
 
-Cons** closure(void* argList, void* body, void* env)
+String* stringOf(const char* chars, const uint64_t length)
 {
-  Cons* c = assocCons(argList, body, objEqual(env, topLevel) ? nil : env);
-  Cons** x = obj(TAG_CLSR, sizeof(Cons*));
-  memcpy(x, &c, sizeof(Cons*));
+  String* x = stringBuffer(length);
+  memcpy(x->chars, chars, length);
+  return x;
+}
+
+String* string(char* str) { return stringOf(str, strlen(str)); }
+
+// a string over chars, which must be collected and NUL-terminated, without copying them
+String* stringWrap(char* chars, const uint64_t length)
+{
+  String* x = (String*)obj(TAG_STR, sizeof(String));
+  x->length = length;
+  x->chars = chars;
+  return x;
+}
+
+String* stringSlice(const String* s, const uint64_t start, const uint64_t end)
+{
+  String* x = (String*)obj(TAG_STR, sizeof(String));
+  x->length = end - start;
+  x->chars = s->chars + start;
+  return x;
+}
+
+// NUL-terminated characters for C interfaces; copies only slices that need it
+char* stringCString(const String* s)
+{
+  // a slice ends inside the string it was cut from, so the byte after it is readable
+  if (!s->chars[s->length]) return s->chars;
+  char* c = objAllocAtomic(s->length + 1);
+  memcpy(c, s->chars, s->length);
+  c[s->length] = '\0';
+  return c;
+}
+
+Lambda* lambda(void* params, void* body)
+{
+  Lambda* x = (Lambda*)obj(TAG_LAMBDA, sizeof(Lambda));
+  x->params = params;
+  x->body = body;
+  x->code = NULL;
+  x->name = NULL;
+  return x;
+}
+
+Closure* closure(Lambda* lambda, void* env)
+{
+  // capture the local frames only; globals are shared through topLevel
+  Closure* x = (Closure*)obj(TAG_CLSR, sizeof(Closure));
+  x->lambda = lambda;
+  x->env = env;
   return x;
 }
 
@@ -59,33 +161,44 @@ Cons** macro(void* argList, void* body)
   return x;
 }
 
-static void* fnCons(void* argList, void* env)
+// Tail primitives hand back an expression rather than a value. A value that would not
+// evaluate to itself is wrapped in a quote form headed by the quote primitive.
+static void* quotePrim = NULL;
+static void* tailValue(void* x)
 {
-  if (consCount(argList) != 2)
+  switch (getObjTag(x))
+  {
+    case TAG_SYM: case TAG_CONS: case TAG_REF: case TAG_LAMBDA: return cons(quotePrim, cons(x, nil));
+    default: return x;
+  }
+}
+
+static void* fnCons(uint64_t argc, void** argv)
+{
+  if (argc != 2)
     return symbol("ERROR: cons FAILED; MUST BE OF THE FORM (cons expr-1 expr-2)");
-  void* l = evalList(argList, env);
-  return cons(car(l), car(cdr(l)));
+  return cons(argv[0], argv[1]);
 }
 
-static void* fnCar(void* argList, void* env)
+static void* fnCar(uint64_t argc, void** argv)
 {
-  if (consCount(argList) != 1)
+  if (argc != 1)
     return symbol("ERROR: car FAILED; MUST BE OF THE FORM (car pair)");
-  return car(eval(car(argList), env));
+  return car(argv[0]);
 }
 
-static void* fnCdr(void* argList, void* env)
+static void* fnCdr(uint64_t argc, void** argv)
 {
-  if (consCount(argList) != 1)
+  if (argc != 1)
     return symbol("ERROR: cdr FAILED; MUST BE OF THE FORM (cdr pair)");
-  return cdr(eval(car(argList), env));
+  return cdr(argv[0]);
 }
 
 static void* fnEval(void* argList, void* env)
 {
   if (consCount(argList) != 1)
-    return symbol("ERROR: eval FAILED; MUST BE OF THE FORM (eval expr)");
-  return eval(eval(car(argList), env), env);
+    return tailValue(symbol("ERROR: eval FAILED; MUST BE OF THE FORM (eval expr)"));
+  return eval(car(argList), env);
 }
 
 static void* fnQuote(void* argList, void* env)
@@ -97,13 +210,16 @@ static void* fnQuote(void* argList, void* env)
 
 static void* fnAll(void* argList, void* env)
 {
-  if (!consCount(argList)) return symbol("ERROR: all FAILED; MUST BE OF THE FORM (all expr ...)");
-  void* x = nil;
-  for (void* l = evalList(argList, env); getObjTag(l) != TAG_NIL; l = cdr(l)) x = car(l);
-  return x;
+  if (!consCount(argList)) return tailValue(symbol("ERROR: all FAILED; MUST BE OF THE FORM (all expr ...)"));
+  for (; getObjTag(cdr(argList)) == TAG_CONS; argList = cdr(argList)) eval(car(argList), env);
+  return car(argList);
 }
 
-static void* fnLambda(void* argList, void* env) { return closure(car(argList), cdr(argList), env); }
+static void* fnLambda(void* argList, void* env)
+{
+  void* params = car(argList);
+  return closure(lambda(params, analyseBody(params, cdr(argList), env)), env);
+}
 
 static void* fnMacro(void* argList, void* env) { return macro(car(argList), cdr(argList)); }
 
@@ -112,65 +228,61 @@ static void* fnGlobal(void* argList, void* env)
   if (consCount(argList) != 2)
     return symbol("ERROR: global FAILED; MUST BE OF THE FORM (global variable expr)");
   void* x = car(argList);
-  topLevel = assocCons(x, eval(car(cdr(argList)), env), topLevel);
+  void* old = tableRef(topLevel, x);
+  if (old && getObjTag(old) == TAG_MACRO) macroCacheClear();
+  globalSet(x, eval(car(cdr(argList)), env));
   return x;
 }
 
 static void* fnAnd(void* argList, void* env)
 {
-  if (!consCount(argList)) return symbol("ERROR: and FAILED; MUST BE OF THE FORM (and expr ...)");
-  void* x = nil;
-  for (; getObjTag(argList) != TAG_NIL; argList = cdr(argList))
-  {
-    x = eval(car(argList), env);
-    if (getObjTag(x) == TAG_NIL) break;
-  }
-  return x;
+  if (!consCount(argList)) return tailValue(symbol("ERROR: and FAILED; MUST BE OF THE FORM (and expr ...)"));
+  for (; getObjTag(cdr(argList)) == TAG_CONS; argList = cdr(argList))
+    if (getObjTag(eval(car(argList), env)) == TAG_NIL) return nil;
+  return car(argList);
 }
 
 static void* fnOr(void* argList, void* env)
 {
-  if (!consCount(argList)) return symbol("ERROR: or FAILED; MUST BE OF THE FORM (or expr ...)");
-  void* x = nil;
-  for (; getObjTag(argList) != TAG_NIL; argList = cdr(argList))
+  if (!consCount(argList)) return tailValue(symbol("ERROR: or FAILED; MUST BE OF THE FORM (or expr ...)"));
+  for (; getObjTag(cdr(argList)) == TAG_CONS; argList = cdr(argList))
   {
-    x = eval(car(argList), env);
-    if (getObjTag(x) != TAG_NIL) break;
+    void* x = eval(car(argList), env);
+    if (getObjTag(x) != TAG_NIL) return tailValue(x);
   }
-  return x;
+  return car(argList);
 }
 
-static void* fnNot(void* argList, void* env)
+static void* fnNot(uint64_t argc, void** argv)
 {
-  if (consCount(argList) != 1) return symbol("ERROR: not? FAILED; MUST BE OF THE FORM (not? expr)");
-  return getObjTag(car(evalList(argList, env))) == TAG_NIL ? truth : nil;
+  if (argc != 1) return symbol("ERROR: not? FAILED; MUST BE OF THE FORM (not? expr)");
+  return getObjTag(argv[0]) == TAG_NIL ? truth : nil;
 }
 
-static void* fnEq(void* argList, void* env)
+static void* fnEq(uint64_t argc, void** argv)
 {
-  if (consCount(argList) != 2) return symbol("ERROR: eq? FAILED; MUST BE OF THE FORM (eq? expr-1 expr-2)");
-  void* l = evalList(argList, env);
-  return objEqual(car(l), car(cdr(l))) ? truth : nil;
+  if (argc != 2) return symbol("ERROR: eq? FAILED; MUST BE OF THE FORM (eq? expr-1 expr-2)");
+  return objEqual(argv[0], argv[1]) ? truth : nil;
 }
 
 static void* fnIf(void* argList, void* env)
 {
-  if (consCount(argList) != 3) return symbol("ERROR: if FAILED; MUST BE OF THE FORM (if test-expr then-expr else-expr);");
+  if (consCount(argList) != 3) return tailValue(symbol("ERROR: if FAILED; MUST BE OF THE FORM (if test-expr then-expr else-expr);"));
   const uint8_t test = getObjTag(eval(car(argList), env)) != TAG_NIL;
   argList = cdr(argList);
-  return eval(car(test ? argList : cdr(argList)), env);
+  return car(test ? argList : cdr(argList));
 }
 
 static void* fnWhen(void* argList, void* env)
 {
-  if (consCount(argList) < 2) return symbol("ERROR: when FAILED; MUST BE OF THE FORM (when test-expr then-expr ...);");
+  if (consCount(argList) < 2) return tailValue(symbol("ERROR: when FAILED; MUST BE OF THE FORM (when test-expr then-expr ...);"));
   const uint8_t test = getObjTag(eval(car(argList), env)) != TAG_NIL;
   return test ? fnAll(cdr(argList), env) : nil;
 }
 
 static void* fnUnless(void* argList, void* env)
 {
-  if (consCount(argList) < 2) return symbol("ERROR: unless FAILED; MUST BE OF THE FORM (unless test-expr then-expr ...);");
+  if (consCount(argList) < 2) return tailValue(symbol("ERROR: unless FAILED; MUST BE OF THE FORM (unless test-expr then-expr ...);"));
   const uint8_t test = getObjTag(eval(car(argList), env)) != TAG_NIL;
   return test ? nil : fnAll(cdr(argList), env);
 }
@@ -178,9 +290,9 @@ static void* fnUnless(void* argList, void* env)
 static void* fnCond(void* argList, void* env)
 {
   char* err = "ERROR: cond FAILED; MUST BE OF THE FORM (cond clause ...) WHERE clause is of the form (test-expr then-expr ...)";
-  if (!consCount(argList)) return symbol(err);
+  if (!consCount(argList)) return tailValue(symbol(err));
   for (void* l = argList; getObjTag(l) != TAG_NIL; l = cdr(l))
-    if (consCount(car(l)) < 2) return symbol(err);
+    if (consCount(car(l)) < 2) return tailValue(symbol(err));
   for (; getObjTag(argList) != TAG_NIL; argList = cdr(argList))
   {
     void * test_expr = car(car(argList));
@@ -190,138 +302,122 @@ static void* fnCond(void* argList, void* env)
   return fnAll(then_list, env);
 }
 
-static void* fnAdd(void* argList, void* env)
+static void* arithmetic(char* err, const char op, uint64_t argc, void** argv)
 {
-  char* err = "ERROR: + FAILED; MUST BE OF THE FORM (+ number ...)";
-  if (!consCount(argList)) return symbol(err);
-  void* l = evalList(argList, env);
-  double n = *((double*)car(l));
-  while (getObjTag(l = cdr(l)) != TAG_NIL)
+  if (!argc) return symbol(err);
+  for (uint64_t i = 0; i < argc; i++)
+    if (getObjTag(argv[i]) != TAG_NUM) return symbol(err);
+  double n = numberValue(argv[0]);
+  for (uint64_t i = 1; i < argc; i++)
   {
-    void* x = car(l);
-    if (getObjTag(x) != TAG_NUM) return symbol(err);
-    n += *((double*)x);
+    const double m = numberValue(argv[i]);
+    switch (op)
+    {
+      case '+': n += m; break;
+      case '-': n -= m; break;
+      case '*': n *= m; break;
+      case '/': n /= m; break;
+    }
   }
+  if (op == '-' && argc == 1) n = -n;
   return number(n);
 }
 
-static void* fnSub(void* argList, void* env)
+static void* fnAdd(uint64_t argc, void** argv)
 {
-  char* err = "ERROR: - FAILED; MUST BE OF THE FORM (- number ...)";
-  if (!consCount(argList)) return symbol(err);
-  void* l = evalList(argList, env);
-  double n = *((double*)car(l));
-  uint8_t count = 0;
-  while (getObjTag(l = cdr(l)) != TAG_NIL)
-  {
-    void* x = car(l);
-    if (getObjTag(x) != TAG_NUM) return symbol(err);
-    n -= *((double*)x);
-    count = 1;
-  }
-  if (!count) n = -n;
-  return number(n);
+  return arithmetic("ERROR: + FAILED; MUST BE OF THE FORM (+ number ...)", '+', argc, argv);
 }
 
-static void* fnMul(void* argList, void* env)
+static void* fnSub(uint64_t argc, void** argv)
 {
-  char* err =  "ERROR: * FAILED; MUST BE OF THE FORM (* number ...)";
-  if (!consCount(argList)) return symbol(err);
-  void* l = evalList(argList, env);
-  double n = *((double*)car(l));
-  while (getObjTag(l = cdr(l)) != TAG_NIL)
-  {
-    void* x = car(l);
-    if (getObjTag(x) != TAG_NUM) return symbol(err);
-    n *= *((double*)x);
-  }
-  return number(n);
+  return arithmetic("ERROR: - FAILED; MUST BE OF THE FORM (- number ...)", '-', argc, argv);
 }
 
-static void* fnDiv(void* argList, void* env)
+static void* fnMul(uint64_t argc, void** argv)
 {
-  char* err =  "ERROR: / FAILED; MUST BE OF THE FORM (/ number ...)";
-  if (!consCount(argList)) return symbol(err);
-  void* l = evalList(argList, env);
-  double n = *((double*)car(l));
-  while (getObjTag(l = cdr(l)) != TAG_NIL)
-  {
-    void* x = car(l);
-    if (getObjTag(x) != TAG_NUM) return symbol(err);
-    n /= *((double*)x);
-  }
-  return number(n);
+  return arithmetic("ERROR: * FAILED; MUST BE OF THE FORM (* number ...)", '*', argc, argv);
+}
+
+static void* fnDiv(uint64_t argc, void** argv)
+{
+  return arithmetic("ERROR: / FAILED; MUST BE OF THE FORM (/ number ...)", '/', argc, argv);
 }
 
-static void* fnPrintf(void* argList, void* env)
+static void* fnPrintf(uint64_t argc, void** argv)
 {
   char* err = "ERROR: printf FAILED; MUST BE OF THE FORM (printf string)";
-  if (!consCount(argList)) return symbol(err);
-  char* x = (char*)nil;
-  for (void* l = evalList(argList, env); getObjTag(l) != TAG_NIL; l = cdr(l))
+  if (!argc) return symbol(err);
+  String* s = nil;
+  outBegin();
+  for (uint64_t k = 0; k < argc; k++)
   {
-    x = (char*)car(l);
-    if (getObjTag(x) != TAG_STR) return symbol(err);
-
-    uint64_t i = 0, j = 0, len = strlen(x) + 1;
-    char* fmt = malloc(sizeof(char) * len);
-    if (!fmt) panic("fnPrintf(): malloc failed");
-    for (; x[i] != '\0'; i++)
+    s = argv[k];
+    if (getObjTag(s) != TAG_STR)
     {
-      if (x[i] == '\\' && i < len - 1)
+      outEnd();
+      return symbol(err);
+    }
+
+    // runs between escapes are written as they are; \n and \t become a newline and a tab,
+    // and a backslash before anything else is written in place of both characters
+    const char* x = s->chars;
+    uint64_t start = 0;
+    for (uint64_t i = 0; i + 1 < s->length; i++)
+      if (x[i] == '\\')
       {
-	switch(x[i + 1])
-	{
-	  case 'n': fmt[j++]= '\n'; i++; break;
-	  case 't': fmt[j++] = '\t'; i++; break;
-	  default: fmt[j++] = x[i++]; break;
-	}
+	outWrite(x + start, i - start);
+	outChar(x[i + 1] == 'n' ? '\n' : x[i + 1] == 't' ? '\t' : '\\');
+	start = ++i + 1;
       }
-      else fmt[j++] = x[i];
-    }
-    fmt[j] = '\0';
-    printf("%s", fmt);
-    free(fmt);
+    outWrite(x + start, s->length - start);
   }
-  return x;
+  outEnd();
+  return s;
 }
 
-static void* fnStringToCharList(void* argList, void* env)
+static void* fnStringToCharList(uint64_t argc, void** argv)
 {
   char* err =  "ERROR: string->char-list FAILED; MUST BE OF THE FORM (string->char-list string)";
-  if (consCount(argList) != 1) return symbol(err);
-  char* str = eval(car(argList), env);
+  if (argc != 1) return symbol(err);
+  String* str = argv[0];
   if (getObjTag(str) != TAG_STR) return symbol(err);
   void* x = nil;
-  for (uint64_t i = 0; str[i] != '\0'; i++)
-    x = cons(number(str[i]), x);
+  for (uint64_t i = 0; i < str->length; i++)
+    x = cons(number(str->chars[i]), x);
   return x;
 }
 
+static void* fnSaveImage(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: save-image FAILED; MUST BE OF THE FORM (save-image path-string)";
+  if (argc != 1 || getObjTag(argv[0]) != TAG_STR) return symbol(err);
+  return imageSave(stringCString(argv[0])) ? truth : nil;
+}
+
 static const Primitive primitives[] =
 {
   // fundamental
   {"cons",              fnCons},
   {"car",               fnCar},
   {"cdr",               fnCdr},
-  {"eval",              fnEval},
-  {"quote",             fnQuote},
-  {"all",               fnAll},
-  {"lambda",            fnLambda},
-  {"macro",             fnMacro},
-  {"global",            fnGlobal},
+  {"eval",              NULL, fnEval, 1},
+  {"quote",             NULL, fnQuote},
+  {"all",               NULL, fnAll, 1},
+  {"lambda",            NULL, fnLambda},
+  {"macro",             NULL, fnMacro},
+  {"global",            NULL, fnGlobal},
   
   // logical operators
-  {"and",               fnAnd},
-  {"or",                fnOr},
+  {"and",               NULL, fnAnd, 1},
+  {"or",                NULL, fnOr, 1},
   {"not?",              fnNot},
   {"eq?",               fnEq},
 
   // control flow
-  {"if",                fnIf},
-  {"when",              fnWhen},
-  {"unless",            fnUnless},
-  {"cond",              fnCond},
+  {"if",                NULL, fnIf, 1},
+  {"when",              NULL, fnWhen, 1},
+  {"unless",            NULL, fnUnless, 1},
+  {"cond",              NULL, fnCond, 1},
 
   // arithmetic
   {"+",                 fnAdd},
@@ -332,24 +428,98 @@ static const Primitive primitives[] =
   // string
   {"printf",            fnPrintf},
   {"string->char-list", fnStringToCharList},
+  {"string-length",     fnStringLength},
+  {"substring",         fnSubstring},
+  {"string-append",     fnStringAppend},
+  {"string-join",       fnStringJoin},
+  {"string-split",      fnStringSplit},
+  {"string-index",      fnStringIndex},
+  {"string-trim",       fnStringTrim},
+  {"string->number",    fnStringToNumber},
+  {"number->string",    fnNumberToString},
+  {"string=?",          fnStringEq},
+  {"string<?",          fnStringLt},
+  {"string>?",          fnStringGt},
+
+  // vector
+  {"vector",            fnVector},
+  {"make-vector",       fnMakeVector},
+  {"vector-ref",        fnVectorRef},
+  {"vector-set",        fnVectorSet},
+  {"vector-length",     fnVectorLength},
+  {"vector-fill",       fnVectorFill},
+  {"vector-push",       fnVectorPush},
+
+  // f64 array
+  {"f64-array",         fnF64Array},
+  {"make-f64-array",    fnMakeF64Array},
+  {"list->f64-array",   fnListToF64Array},
+  {"f64-array->list",   fnF64ArrayToList},
+  {"f64-array-ref",     fnF64ArrayRef},
+  {"f64-array-set",     fnF64ArraySet},
+  {"f64-array-length",  fnF64ArrayLength},
+  {"f64-add",           fnF64Add},
+  {"f64-sub",           fnF64Sub},
+  {"f64-mul",           fnF64Mul},
+  {"f64-div",           fnF64Div},
+  {"f64-scale",         fnF64Scale},
+  {"f64-sum",           fnF64Sum},
+  {"f64-dot",           fnF64Dot},
+  {"f64-min",           fnF64Min},
+  {"f64-max",           fnF64Max},
+  {"f64-prefix-sum",    fnF64PrefixSum},
+
+  // profiler
+  {"profile-start",     fnProfileStart},
+  {"profile-stop",      fnProfileStop},
+
+  // stats
+  {"stats",             fnStats},
+  {"stats-reset",       fnStatsReset},
+  {"gc-stats",          fnGcStats},
+  {"gc-collect",        fnGcCollect},
+  {"gc-tune",           fnGcTune},
+
+  // parallel
+  {"future",            fnFuture},
+  {"touch",             fnTouch},
+  {"pmap",              fnPmap},
+
+  // hash table
+  {"hash-table",        fnHashTable},
+  {"hash-table-ref",    fnHashTableRef},
+  {"hash-table-set",    fnHashTableSet},
+  {"hash-table-delete", fnHashTableDelete},
+  {"hash-table-count",  fnHashTableCount},
+  {"hash-table->list",  fnHashTableToList},
+  {"hash-table-keys",   fnHashTableKeys},
 
   // system
   {"cd",                fnCd},
   {"cwd",               fnCwd},
   {"run",               fnRun},
   {"daemon",            fnDaemon},
-  {"pipe",              fnPipe}
+  {"pipe",              fnPipe},
+  {"capture",           fnCapture},
+  {"capture-all",       fnCaptureAll},
+  {"run-parallel",      fnRunParallel},
+  {"jobs",              fnJobs},
+  {"job-wait",          fnJobWait},
+  {"job-kill",          fnJobKill},
+
+  // image
+  {"save-image",        fnSaveImage}
 };
 
-PrimitiveFn getPrimitiveFn(uint8_t index) { return primitives[index].fn; }
+const Primitive* getPrimitive(uint8_t index) { return &primitives[index]; }
 
-void* setPrimitives(void* env)
+void setPrimitives(Table* env)
 {
   for (uint8_t i = 0; i < sizeof(primitives) / sizeof(Primitive); i++)
   {
     uint8_t* id = obj(TAG_PRIM, sizeof(uint8_t));
     *id = i;
-    env = assocCons(symbol(primitives[i].name), id, env);
+    if (primitives[i].form == fnQuote) quotePrim = id;
+    tableSet(env, symbol(primitives[i].name), id);
   }
-  return env;
 }
@@ -45,16 +45,14 @@ uint64_t consCount(Cons* x)
 Cons* assocCons(void* const key, void* const v, void* const alist) { return cons(cons(key, v), alist); }
 void* assocRef(void* const key, void* alist)
 {
-  while (getObjTag(alist) == TAG_CONS && !objEqual(key, car(car(alist))))
+  // keys are interned symbols, so a pointer compare is enough
+  while (getObjTag(alist) == TAG_CONS && key != car(car(alist)))
     alist = cdr(alist);
   return getObjTag(alist) == TAG_CONS ? cdr(car(alist)) : symbol("ERROR: ASSOC REF FAILED");
 }
-void* assocList(void* const keyList, void* const vList, void* const alist)
+void* assocList(void* keyList, void* vList, void* alist)
 {
-  switch (getObjTag(keyList))
-  {
-    case TAG_NIL: return alist;
-    case TAG_CONS: return assocList(cdr(keyList), cdr(vList), assocCons(car(keyList), car(vList), alist));
-    default: return assocCons(keyList, vList, alist);
-  }
+  for (; getObjTag(keyList) == TAG_CONS; keyList = cdr(keyList), vList = cdr(vList))
+    alist = assocCons(car(keyList), car(vList), alist);
+  return getObjTag(keyList) == TAG_NIL ? alist : assocCons(keyList, vList, alist);
 }
@@ -0,0 +1,269 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "turtle.h"
+
+// Frames
+// A local environment is either nil or a chain of frames, one per closure call.
+// A frame keeps the parameter list it was built from so code that was not analysed
+// (macro expansions, eval) can still look variables up by name.
+static uint64_t frameSlotCount(void* names)
+{
+  uint64_t count = consCount(names);
+  while (getObjTag(names) == TAG_CONS) names = ((Cons*)names)->cdr;
+  return count + (getObjTag(names) == TAG_SYM); // rest parameter
+}
+
+Frame* frame(void* names, void* vList, void* parent)
+{
+  const uint64_t count = frameSlotCount(names);
+  Frame* f = (Frame*)obj(TAG_FRAME, sizeof(Frame) + count * sizeof(void*));
+  f->parent = parent;
+  f->names = names;
+  f->count = count;
+  uint64_t i = 0;
+  for (; getObjTag(names) == TAG_CONS; names = ((Cons*)names)->cdr, i++)
+  {
+    const uint8_t more = getObjTag(vList) == TAG_CONS;
+    f->slots[i] = more ? ((Cons*)vList)->car : nil;
+    if (more) vList = ((Cons*)vList)->cdr;
+  }
+  if (i < count) f->slots[i] = vList;
+  return f;
+}
+
+Frame* frameArgs(void* names, uint64_t argc, void** argv, void* parent)
+{
+  const uint64_t count = frameSlotCount(names);
+  Frame* f = (Frame*)obj(TAG_FRAME, sizeof(Frame) + count * sizeof(void*));
+  f->parent = parent;
+  f->names = names;
+  f->count = count;
+  uint64_t i = 0;
+  for (; getObjTag(names) == TAG_CONS; names = ((Cons*)names)->cdr, i++)
+    f->slots[i] = i < argc ? argv[i] : nil;
+  if (i < count)
+  {
+    void* rest = nil;
+    for (uint64_t j = argc; j > i; j--) rest = cons(argv[j - 1], rest);
+    f->slots[i] = rest;
+  }
+  return f;
+}
+
+static int64_t slotOf(void* const sym, void* names)
+{
+  int64_t i = 0;
+  for (; getObjTag(names) == TAG_CONS; names = ((Cons*)names)->cdr, i++)
+    if (((Cons*)names)->car == sym) return i;
+  return names == sym ? i : -1;
+}
+
+void* envRef(void* const sym, void* env)
+{
+  STAT(lookups, 1);
+  STAT(nameLookups, 1);
+  for (; getObjTag(env) == TAG_FRAME; env = ((Frame*)env)->parent)
+  {
+    const int64_t i = slotOf(sym, ((Frame*)env)->names);
+    if (i >= 0) return ((Frame*)env)->slots[i];
+    STAT(lookupDepth, 1);
+  }
+  STAT(globalLookups, 1);
+  void* x = tableRef(topLevel, sym);
+  return x ? x : symbol("ERROR: ASSOC REF FAILED");
+}
+
+void* refValue(const Ref* const r, void* env)
+{
+  STAT(lookups, 1);
+  if (r->depth == REF_GLOBAL)
+  {
+    STAT(globalLookups, 1);
+    void* x = tableRef(topLevel, r->sym);
+    return x ? x : symbol("ERROR: ASSOC REF FAILED");
+  }
+  STAT(lookupDepth, r->depth);
+  for (uint32_t d = r->depth; d; d--) env = ((Frame*)env)->parent;
+  return ((Frame*)env)->slots[r->slot];
+}
+
+// Lexical addressing
+// When a lambda is created its body is copied with every variable reference resolved
+// to a (frame depth, slot) pair, or marked global. A scope is a list of parameter
+// lists, innermost first, mirroring the frames that will exist at run time.
+static void* symQuote, * symMacro, * symLambda, * symGlobal; // special forms, interned once by envInit
+
+void envInit()
+{
+  symQuote = symbol("quote");
+  symMacro = symbol("macro");
+  symLambda = symbol("lambda");
+  symGlobal = symbol("global");
+}
+
+// whether sym names a parameter of some enclosing lambda; ref without the allocation
+static uint8_t inScope(void* const sym, void* scope)
+{
+  for (; getObjTag(scope) == TAG_CONS; scope = ((Cons*)scope)->cdr)
+    if (slotOf(sym, ((Cons*)scope)->car) >= 0) return 1;
+  return 0;
+}
+
+static Ref* ref(void* const sym, void* scope)
+{
+  Ref* r = (Ref*)obj(TAG_REF, sizeof(Ref));
+  r->sym = sym;
+  r->depth = REF_GLOBAL;
+  r->slot = 0;
+  for (uint32_t d = 0; getObjTag(scope) == TAG_CONS; scope = ((Cons*)scope)->cdr, d++)
+  {
+    const int64_t i = slotOf(sym, ((Cons*)scope)->car);
+    if (i >= 0)
+    {
+      r->depth = d;
+      r->slot = (uint32_t)i;
+      break;
+    }
+  }
+  return r;
+}
+
+static void* analyse(void* x, void* scope);
+static void* analyseList(void* l, void* scope)
+{
+  void* head = nil;
+  Cons* tail = NULL;
+  for (; getObjTag(l) == TAG_CONS; l = ((Cons*)l)->cdr)
+  {
+    Cons* c = cons(analyse(((Cons*)l)->car, scope), nil);
+    if (tail) tail->cdr = c; else head = c;
+    tail = c;
+  }
+  if (getObjTag(l) != TAG_NIL)
+  {
+    if (tail) tail->cdr = analyse(l, scope); else head = analyse(l, scope);
+  }
+  return head;
+}
+
+static Lambda* lambdaTemplate(void* params, void* body, void* scope)
+{
+  return lambda(params, analyseList(body, cons(params, scope)));
+}
+
+static void* analyse(void* x, void* scope)
+{
+  switch (getObjTag(x))
+  {
+    case TAG_SYM: return ref(x, scope);
+    case TAG_CONS:
+    {
+      void* head = ((Cons*)x)->car, * args = ((Cons*)x)->cdr;
+      if (getObjTag(head) == TAG_SYM && !inScope(head, scope))
+      {
+	// special forms whose arguments are not all evaluated in this scope
+	if (head == symQuote || head == symMacro) return x;
+	if (head == symLambda && getObjTag(args) == TAG_CONS)
+	  return lambdaTemplate(car(args), cdr(args), scope);
+	if (head == symGlobal && getObjTag(args) == TAG_CONS)
+	  return cons(ref(head, scope), cons(car(args), analyseList(cdr(args), scope)));
+      }
+      return analyseList(x, scope);
+    }
+    default: return x;
+  }
+}
+
+void* envScope(void* env)
+{
+  void* scope = nil;
+  Cons* tail = NULL;
+  for (; getObjTag(env) == TAG_FRAME; env = ((Frame*)env)->parent)
+  {
+    Cons* c = cons(((Frame*)env)->names, nil);
+    if (tail) tail->cdr = c; else scope = c;
+    tail = c;
+  }
+  return scope;
+}
+
+uint8_t envScopeMatches(void* scope, void* env)
+{
+  for (; getObjTag(env) == TAG_FRAME; env = ((Frame*)env)->parent, scope = ((Cons*)scope)->cdr)
+    if (getObjTag(scope) != TAG_CONS || ((Cons*)scope)->car != ((Frame*)env)->names) return 0;
+  return getObjTag(scope) == TAG_NIL;
+}
+
+void* analyseForm(void* x, void* env) { return analyse(x, envScope(env)); }
+void* analyseSeq(void* l, void* scope) { return analyseList(l, scope); }
+void* analyseBody(void* params, void* body, void* env) { return analyseList(body, cons(params, envScope(env))); }
+
+static void listAppend(void** head, Cons** tail, void* x)
+{
+  Cons* c = cons(x, nil);
+  if (*tail) (*tail)->cdr = c; else *head = c;
+  *tail = c;
+}
+
+// appends the elements of l before end; returns 1
+static uint8_t copyPrefix(void* l, void* end, void** head, Cons** tail)
+{
+  for (; l != end; l = ((Cons*)l)->cdr) listAppend(head, tail, ((Cons*)l)->car);
+  return 1;
+}
+
+// Macros receive their argument forms unevaluated, so hand them back the source
+// they were analysed from.
+void* unresolve(void* x)
+{
+  switch (getObjTag(x))
+  {
+    case TAG_REF: return ((Ref*)x)->sym;
+    case TAG_LAMBDA:
+    {
+      Lambda* l = (Lambda*)x;
+      return cons(symLambda, cons(l->params, unresolve(l->body)));
+    }
+    case TAG_CONS:
+    {
+      // walk the cdr chain in place, recursing only into cars, and copy the list only
+      // once an element changes
+      void* head = nil, * l = x;
+      Cons* tail = NULL;
+      uint8_t copying = 0;
+      for (; getObjTag(l) == TAG_CONS; l = ((Cons*)l)->cdr)
+      {
+	void* a = ((Cons*)l)->car, * ua = unresolve(a);
+	if (ua != a && !copying) copying = copyPrefix(x, l, &head, &tail);
+	if (copying) listAppend(&head, &tail, ua);
+      }
+      void* ul = unresolve(l);
+      if (!copying)
+      {
+	if (ul == l) return x;
+	copyPrefix(x, l, &head, &tail);
+      }
+      if (tail) tail->cdr = ul; else head = ul;
+      return head;
+    }
+    default: return x;
+  }
+}
@@ -0,0 +1,277 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "turtle.h"
+
+// Packed double arrays
+// Elements are unboxed in a pointer-free block the collector does not scan. The bulk
+// primitives run on four-lane vector kernels; on x86-64 each kernel is also built for
+// AVX2 and the best version is picked when the program loads. Sums are accumulated
+// lane-wise, so they may round differently from a left-to-right sum.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define KERNEL
+#endif
+
+#define LANES 4
+typedef double v4d __attribute__((vector_size(LANES * sizeof(double))));
+typedef int64_t v4i __attribute__((vector_size(LANES * sizeof(int64_t))));
+
+typedef double v4du __attribute__((vector_size(LANES * sizeof(double)), aligned(sizeof(double)))); // unaligned access
+
+// macros rather than functions so no vector crosses a call in the non-AVX build
+#define load(p) (*(const v4du*)(p))
+#define store(p, x) (*(v4du*)(p) = (x))
+#define blend(mask, a, b) ((v4d)(((v4i)(a) & (mask)) | ((v4i)(b) & ~(mask))))
+#define splat(x) ((v4d){(x), (x), (x), (x)})
+#if defined(__clang__)
+#define SHIFT1(x) __builtin_shufflevector((x), (v4d){0}, 4, 0, 1, 2)
+#define SHIFT2(x) __builtin_shufflevector((x), (v4d){0}, 4, 4, 0, 1)
+#else
+#define SHIFT1(x) __builtin_shuffle((x), (v4d){0}, (v4i){4, 0, 1, 2})
+#define SHIFT2(x) __builtin_shuffle((x), (v4d){0}, (v4i){4, 4, 0, 1})
+#endif
+
+F64Array* f64Array(const uint64_t count)
+{
+  F64Array* a = (F64Array*)obj(TAG_F64, sizeof(F64Array));
+  a->count = count;
+  a->data = objAllocAtomic((count ? count : 1) * sizeof(double));
+  return a;
+}
+
+// Kernels /////////////////////////////////////////////////////////////////////////////////////////
+#define BINARY(OP)								\
+  for (; i + LANES <= n; i += LANES) store(out + i, load(a + i) OP load(b + i)); \
+  for (; i < n; i++) out[i] = a[i] OP b[i];					\
+  return;
+
+KERNEL static void kernelBinary(const char op, const uint64_t n, double* out, const double* a, const double* b)
+{
+  uint64_t i = 0;
+  switch (op)
+  {
+    case '+': BINARY(+)
+    case '-': BINARY(-)
+    case '*': BINARY(*)
+    case '/': BINARY(/)
+  }
+}
+
+KERNEL static void kernelScale(const uint64_t n, double* out, const double* a, const double k)
+{
+  uint64_t i = 0;
+  for (const v4d kv = splat(k); i + LANES <= n; i += LANES) store(out + i, load(a + i) * kv);
+  for (; i < n; i++) out[i] = a[i] * k;
+}
+
+// sum of a, or of a times b when b is given
+KERNEL static double kernelSum(const uint64_t n, const double* a, const double* b)
+{
+  v4d acc = {0};
+  uint64_t i = 0;
+  if (b) for (; i + LANES <= n; i += LANES) acc += load(a + i) * load(b + i);
+  else for (; i + LANES <= n; i += LANES) acc += load(a + i);
+  double s = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+  for (; i < n; i++) s += b ? a[i] * b[i] : a[i];
+  return s;
+}
+
+// smallest element of a (largest if max is set); n > 0
+KERNEL static double kernelExtreme(const uint64_t n, const double* a, const uint8_t max)
+{
+  uint64_t i = 0;
+  double m = a[0];
+  if (n >= LANES)
+  {
+    v4d acc = load(a);
+    for (i = LANES; i + LANES <= n; i += LANES)
+    {
+      const v4d x = load(a + i);
+      acc = blend(max ? x > acc : x < acc, x, acc);
+    }
+    m = acc[0];
+    for (uint8_t j = 1; j < LANES; j++) if (max ? acc[j] > m : acc[j] < m) m = acc[j];
+  }
+  for (; i < n; i++) if (max ? a[i] > m : a[i] < m) m = a[i];
+  return m;
+}
+
+// inclusive prefix sum; each block is scanned in registers and offset by the running total
+KERNEL static void kernelPrefixSum(const uint64_t n, double* out, const double* a)
+{
+  uint64_t i = 0;
+  v4d carry = {0};
+  for (; i + LANES <= n; i += LANES)
+  {
+    v4d x = load(a + i);
+    x += SHIFT1(x);
+    x += SHIFT2(x);
+    x += carry;
+    store(out + i, x);
+    carry = splat(x[LANES - 1]);
+  }
+  for (double s = carry[0]; i < n; i++) out[i] = s += a[i];
+}
+
+// Primitives //////////////////////////////////////////////////////////////////////////////////////
+
+// valid index into a, or -1
+static int64_t f64Index(const F64Array* const a, const void* const i)
+{
+  if (getObjTag(i) != TAG_NUM) return -1;
+  const double n = numberValue(i);
+  return (n >= 0 && n < (double)a->count && n == (double)(uint64_t)n) ? (int64_t)n : -1;
+}
+
+void* fnF64Array(uint64_t argc, void** argv)
+{
+  for (uint64_t i = 0; i < argc; i++)
+    if (getObjTag(argv[i]) != TAG_NUM) return symbol("ERROR: f64-array FAILED; MUST BE OF THE FORM (f64-array number ...)");
+  F64Array* a = f64Array(argc);
+  for (uint64_t i = 0; i < argc; i++) a->data[i] = numberValue(argv[i]);
+  return a;
+}
+
+void* fnMakeF64Array(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: make-f64-array FAILED; MUST BE OF THE FORM (make-f64-array count [fill-number])";
+  if (argc < 1 || argc > 2 || getObjTag(argv[0]) != TAG_NUM || (argc == 2 && getObjTag(argv[1]) != TAG_NUM)) return symbol(err);
+  const double n = numberValue(argv[0]);
+  if (!(n >= 0 && n <= FIXNUM_MAX) || n != (double)(uint64_t)n) return symbol(err);
+  F64Array* a = f64Array((uint64_t)n);
+  const double fill = argc == 2 ? numberValue(argv[1]) : 0;
+  for (uint64_t i = 0; i < a->count; i++) a->data[i] = fill;
+  return a;
+}
+
+void* fnListToF64Array(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: list->f64-array FAILED; MUST BE OF THE FORM (list->f64-array number-list)";
+  if (argc != 1) return symbol(err);
+  F64Array* a = f64Array(consCount(argv[0]));
+  uint64_t i = 0;
+  for (void* l = argv[0]; getObjTag(l) == TAG_CONS; l = ((Cons*)l)->cdr, i++)
+  {
+    if (getObjTag(((Cons*)l)->car) != TAG_NUM) return symbol(err);
+    a->data[i] = numberValue(((Cons*)l)->car);
+  }
+  return a;
+}
+
+void* fnF64ArrayToList(uint64_t argc, void** argv)
+{
+  if (argc != 1 || getObjTag(argv[0]) != TAG_F64)
+    return symbol("ERROR: f64-array->list FAILED; MUST BE OF THE FORM (f64-array->list f64-array)");
+  const F64Array* a = argv[0];
+  void* x = nil;
+  for (uint64_t i = a->count; i; i--) x = cons(number(a->data[i - 1]), x);
+  return x;
+}
+
+void* fnF64ArrayRef(uint64_t argc, void** argv)
+{
+  if (argc != 2 || getObjTag(argv[0]) != TAG_F64)
+    return symbol("ERROR: f64-array-ref FAILED; MUST BE OF THE FORM (f64-array-ref f64-array index)");
+  const int64_t i = f64Index(argv[0], argv[1]);
+  return i < 0 ? symbol("ERROR: f64-array-ref FAILED; INDEX OUT OF RANGE") : number(((F64Array*)argv[0])->data[i]);
+}
+
+void* fnF64ArraySet(uint64_t argc, void** argv)
+{
+  if (argc != 3 || getObjTag(argv[0]) != TAG_F64 || getObjTag(argv[2]) != TAG_NUM)
+    return symbol("ERROR: f64-array-set FAILED; MUST BE OF THE FORM (f64-array-set f64-array index number)");
+  const int64_t i = f64Index(argv[0], argv[1]);
+  if (i < 0) return symbol("ERROR: f64-array-set FAILED; INDEX OUT OF RANGE");
+  ((F64Array*)argv[0])->data[i] = numberValue(argv[2]);
+  return argv[2];
+}
+
+void* fnF64ArrayLength(uint64_t argc, void** argv)
+{
+  if (argc != 1 || getObjTag(argv[0]) != TAG_F64)
+    return symbol("ERROR: f64-array-length FAILED; MUST BE OF THE FORM (f64-array-length f64-array)");
+  return number((double)((F64Array*)argv[0])->count);
+}
+
+static void* binary(char* err, const char op, uint64_t argc, void** argv)
+{
+  if (argc != 2 || getObjTag(argv[0]) != TAG_F64 || getObjTag(argv[1]) != TAG_F64) return symbol(err);
+  const F64Array* a = argv[0], * b = argv[1];
+  if (a->count != b->count) return symbol(err);
+  F64Array* out = f64Array(a->count);
+  kernelBinary(op, a->count, out->data, a->data, b->data);
+  return out;
+}
+void* fnF64Add(uint64_t argc, void** argv) { return binary("ERROR: f64-add FAILED; MUST BE OF THE FORM (f64-add f64-array-1 f64-array-2) WITH EQUAL LENGTHS", '+', argc, argv); }
+void* fnF64Sub(uint64_t argc, void** argv) { return binary("ERROR: f64-sub FAILED; MUST BE OF THE FORM (f64-sub f64-array-1 f64-array-2) WITH EQUAL LENGTHS", '-', argc, argv); }
+void* fnF64Mul(uint64_t argc, void** argv) { return binary("ERROR: f64-mul FAILED; MUST BE OF THE FORM (f64-mul f64-array-1 f64-array-2) WITH EQUAL LENGTHS", '*', argc, argv); }
+void* fnF64Div(uint64_t argc, void** argv) { return binary("ERROR: f64-div FAILED; MUST BE OF THE FORM (f64-div f64-array-1 f64-array-2) WITH EQUAL LENGTHS", '/', argc, argv); }
+
+void* fnF64Scale(uint64_t argc, void** argv)
+{
+  if (argc != 2 || getObjTag(argv[0]) != TAG_F64 || getObjTag(argv[1]) != TAG_NUM)
+    return symbol("ERROR: f64-scale FAILED; MUST BE OF THE FORM (f64-scale f64-array number)");
+  const F64Array* a = argv[0];
+  F64Array* out = f64Array(a->count);
+  kernelScale(a->count, out->data, a->data, numberValue(argv[1]));
+  return out;
+}
+
+void* fnF64Sum(uint64_t argc, void** argv)
+{
+  if (argc != 1 || getObjTag(argv[0]) != TAG_F64)
+    return symbol("ERROR: f64-sum FAILED; MUST BE OF THE FORM (f64-sum f64-array)");
+  return number(kernelSum(((F64Array*)argv[0])->count, ((F64Array*)argv[0])->data, NULL));
+}
+
+void* fnF64Dot(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: f64-dot FAILED; MUST BE OF THE FORM (f64-dot f64-array-1 f64-array-2) WITH EQUAL LENGTHS";
+  if (argc != 2 || getObjTag(argv[0]) != TAG_F64 || getObjTag(argv[1]) != TAG_F64) return symbol(err);
+  const F64Array* a = argv[0], * b = argv[1];
+  if (a->count != b->count) return symbol(err);
+  return number(kernelSum(a->count, a->data, b->data));
+}
+
+void* fnF64Min(uint64_t argc, void** argv)
+{
+  if (argc != 1 || getObjTag(argv[0]) != TAG_F64 || !((F64Array*)argv[0])->count)
+    return symbol("ERROR: f64-min FAILED; MUST BE OF THE FORM (f64-min non-empty-f64-array)");
+  return number(kernelExtreme(((F64Array*)argv[0])->count, ((F64Array*)argv[0])->data, 0));
+}
+
+void* fnF64Max(uint64_t argc, void** argv)
+{
+  if (argc != 1 || getObjTag(argv[0]) != TAG_F64 || !((F64Array*)argv[0])->count)
+    return symbol("ERROR: f64-max FAILED; MUST BE OF THE FORM (f64-max non-empty-f64-array)");
+  return number(kernelExtreme(((F64Array*)argv[0])->count, ((F64Array*)argv[0])->data, 1));
+}
+
+void* fnF64PrefixSum(uint64_t argc, void** argv)
+{
+  if (argc != 1 || getObjTag(argv[0]) != TAG_F64)
+    return symbol("ERROR: f64-prefix-sum FAILED; MUST BE OF THE FORM (f64-prefix-sum f64-array)");
+  const F64Array* a = argv[0];
+  F64Array* out = f64Array(a->count);
+  kernelPrefixSum(a->count, out->data, a->data);
+  return out;
+}
@@ -0,0 +1,258 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "turtle.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Heap images
+// An image holds topLevel and everything reachable from it, laid out like the live heap:
+// each object is a header word followed by its payload. References between objects are
+// stored as image offsets tagged with IMAGE_REF; immediates are stored as they are.
+//
+// Loading maps the file privately and relocates it in place, so the objects are used
+// straight from the mapping. The mapping is registered as a root region with the collector
+// and is never freed. Symbols are re-interned and primitives are resolved by name, so an
+// image survives changes to the primitive table. The header word keeps the tag in its low
+// byte, as obj() does, and the payload size above it so records can be walked. Futures
+// belong to the running process and have no layout; references to them are saved as nil.
+#define IMAGE_MAGIC 0x314d494c54525554ULL // "TURTLIM1"
+#define IMAGE_VERSION 4
+#define IMAGE_REF 4
+
+typedef struct ImageHeader { uint64_t magic, version, wordSize, size, root; } ImageHeader;
+
+static uint64_t pad(const uint64_t size) { return (size + 7) & ~(uint64_t)7; }
+
+static uint64_t payloadSize(void* x)
+{
+  switch (getObjTag(x))
+  {
+    case TAG_SYM: return pad(strlen(x) + 1);
+    case TAG_STR: return pad(sizeof(String) + ((String*)x)->length + 1);
+    case TAG_NUM: return sizeof(double);
+    case TAG_PRIM: return pad(strlen(getPrimitive(*((uint8_t*)x))->name) + 1);
+    case TAG_CLSR: return sizeof(Closure);
+    case TAG_MACRO: return sizeof(Cons*);
+    case TAG_CONS: return sizeof(Cons);
+    case TAG_TABLE: return sizeof(Table) + (((Table*)x)->capacity + 1) * sizeof(TableEntry); // with the capacity header
+    case TAG_FRAME: return sizeof(Frame) + ((Frame*)x)->count * sizeof(void*);
+    case TAG_REF: return sizeof(Ref);
+    case TAG_LAMBDA: return sizeof(Lambda);
+    case TAG_VECTOR: return sizeof(Vector) + ((Vector*)x)->count * sizeof(void*);
+    case TAG_F64: return sizeof(F64Array) + ((F64Array*)x)->count * sizeof(double);
+    case TAG_NIL: return 0;
+    case TAG_FUTURE: return 0;
+    default: return 0;
+  }
+}
+
+// calls fn on each reference slot of x
+static void eachRef(void* x, void (*fn)(void** slot, void* ctx), void* ctx)
+{
+  switch (getObjTag(x))
+  {
+    case TAG_CLSR: fn((void**)&((Closure*)x)->lambda, ctx); fn(&((Closure*)x)->env, ctx); return;
+    case TAG_MACRO: fn((void**)x, ctx); return;
+    case TAG_CONS: fn(&((Cons*)x)->car, ctx); fn(&((Cons*)x)->cdr, ctx); return;
+    case TAG_TABLE:
+    {
+      Table* t = (Table*)x;
+      for (uint64_t i = 0; i < t->capacity; i++)
+      {
+	fn(&t->entries[i].key, ctx);
+	fn(&t->entries[i].v, ctx);
+      }
+      return;
+    }
+    case TAG_FRAME:
+    {
+      Frame* f = (Frame*)x;
+      fn((void**)&f->parent, ctx);
+      fn(&f->names, ctx);
+      for (uint64_t i = 0; i < f->count; i++) fn(&f->slots[i], ctx);
+      return;
+    }
+    case TAG_REF: fn(&((Ref*)x)->sym, ctx); return;
+    case TAG_LAMBDA: fn(&((Lambda*)x)->params, ctx); fn(&((Lambda*)x)->body, ctx); fn((void**)&((Lambda*)x)->name, ctx); return;
+    case TAG_VECTOR:
+      for (uint64_t i = 0; i < ((Vector*)x)->count; i++) fn(&((Vector*)x)->items[i], ctx);
+      return;
+    default: return;
+  }
+}
+
+static uint8_t isHeapRef(const void* const x) { return x && !((uintptr_t)x & IMM_MASK); }
+
+// Save ////////////////////////////////////////////////////////////////////////////////////////////
+typedef struct ImageWriter { Table* offsets; void** pending; uint64_t pendingCount, pendingCapacity, size; char* out; } ImageWriter;
+
+static void discover(void** slot, void* ctx)
+{
+  ImageWriter* w = ctx;
+  void* x = *slot;
+  if (!isHeapRef(x) || tableRef(w->offsets, x) || !payloadSize(x)) return;
+  w->size += sizeof(uint64_t);
+  tableSet(w->offsets, x, number((double)w->size));
+  w->size += payloadSize(x);
+  if (w->pendingCount == w->pendingCapacity)
+  {
+    w->pendingCapacity = w->pendingCapacity ? 2 * w->pendingCapacity : 1024;
+    void** pending = objAllocValues(w->pendingCapacity * sizeof(void*));
+    if (w->pendingCount) memcpy(pending, w->pending, w->pendingCount * sizeof(void*));
+    w->pending = pending;
+  }
+  w->pending[w->pendingCount++] = x;
+}
+
+static void encode(void** slot, void* ctx)
+{
+  ImageWriter* w = ctx;
+  void* x = *slot;
+  if (!isHeapRef(x)) return;
+  void* offset = tableRef(w->offsets, x);
+  *slot = offset ? (void*)(((uint64_t)numberValue(offset)) | IMAGE_REF) : nil;
+}
+
+uint8_t imageSave(const char* path)
+{
+  ImageWriter w = {table(1024), NULL, 0, 0, sizeof(ImageHeader), NULL};
+  void* root = topLevel;
+  discover(&root, &w);
+  for (uint64_t i = 0; i < w.pendingCount; i++) eachRef(w.pending[i], discover, &w);
+
+  w.out = calloc(1, w.size);
+  if (!w.out) panic("imageSave(): calloc failed");
+  ImageHeader h = {IMAGE_MAGIC, IMAGE_VERSION, sizeof(void*), w.size, (uint64_t)numberValue(tableRef(w.offsets, root)) | IMAGE_REF};
+  memcpy(w.out, &h, sizeof(ImageHeader));
+  for (uint64_t i = 0; i < w.pendingCount; i++)
+  {
+    void* x = w.pending[i];
+    const uint64_t size = payloadSize(x), offset = (uint64_t)numberValue(tableRef(w.offsets, x));
+    char* dst = w.out + offset;
+    const uint64_t header = getObjTag(x) | (size << 8);
+    memcpy(dst - sizeof(uint64_t), &header, sizeof(uint64_t));
+    // strings, tables, vectors and f64 arrays keep their storage inline, right after the object
+    switch (getObjTag(x))
+    {
+      case TAG_STR:
+	memcpy(dst, x, sizeof(String));
+	memcpy(dst + sizeof(String), ((String*)x)->chars, ((String*)x)->length);
+	((String*)dst)->chars = NULL; // slices are saved as whole strings
+	break;
+      case TAG_PRIM: strcpy(dst, getPrimitive(*((uint8_t*)x))->name); break;
+      case TAG_TABLE:
+	memcpy(dst, x, sizeof(Table));
+	memcpy(dst + sizeof(Table), ((Table*)x)->entries - 1, (((Table*)x)->capacity + 1) * sizeof(TableEntry));
+	((Table*)dst)->entries = (TableEntry*)(dst + sizeof(Table)) + 1;
+	break;
+      case TAG_VECTOR:
+	memcpy(dst, x, sizeof(Vector));
+	memcpy(dst + sizeof(Vector), ((Vector*)x)->items, ((Vector*)x)->count * sizeof(void*));
+	((Vector*)dst)->capacity = ((Vector*)dst)->count;
+	((Vector*)dst)->items = (void**)(dst + sizeof(Vector));
+	break;
+      case TAG_F64:
+	memcpy(dst, x, sizeof(F64Array));
+	memcpy(dst + sizeof(F64Array), ((F64Array*)x)->data, ((F64Array*)x)->count * sizeof(double));
+	((F64Array*)dst)->data = NULL;
+	break;
+      case TAG_LAMBDA:
+	memcpy(dst, x, size);
+	((Lambda*)dst)->code = NULL; // recompiled on demand
+	break;
+      default: memcpy(dst, x, size); break;
+    }
+    eachRef(dst, encode, &w);
+    if (getObjTag(x) == TAG_TABLE) ((Table*)dst)->entries = NULL;  // reattached on load
+    if (getObjTag(x) == TAG_VECTOR) ((Vector*)dst)->items = NULL;
+  }
+
+  FILE* f = fopen(path, "wb");
+  uint8_t ok = f && fwrite(w.out, 1, w.size, f) == w.size;
+  if (f && fclose(f)) ok = 0;
+  free(w.out);
+  return ok;
+}
+
+// Load ////////////////////////////////////////////////////////////////////////////////////////////
+static void relocate(void** slot, void* base)
+{
+  const uint64_t x = (uint64_t)*slot;
+  if ((x & IMM_MASK) != IMAGE_REF) return;
+  void* target = (char*)base + (x & ~(uint64_t)IMM_MASK);
+  switch (getObjTag(target))
+  {
+    case TAG_SYM: *slot = symbol(target); return;
+    case TAG_PRIM:
+    {
+      void* prim = tableRef(topLevel, symbol(target)); // topLevel still holds only the builtins
+      *slot = (prim && getObjTag(prim) == TAG_PRIM) ? prim : nil;
+      return;
+    }
+    default: *slot = target; return;
+  }
+}
+
+uint8_t imageLoad(const char* path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return 0;
+  struct stat st;
+  ImageHeader h;
+  if (fstat(fd, &st) || (uint64_t)st.st_size < sizeof(ImageHeader)
+      || pread(fd, &h, sizeof(h), 0) != sizeof(h)
+      || h.magic != IMAGE_MAGIC || h.version != IMAGE_VERSION || h.wordSize != sizeof(void*) || h.size != (uint64_t)st.st_size)
+  {
+    close(fd);
+    return 0;
+  }
+  char* base = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return 0;
+
+  for (uint64_t at = sizeof(ImageHeader); at < h.size;)
+  {
+    void* x = base + at + sizeof(uint64_t);
+    const uint64_t size = *((uint64_t*)(base + at)) >> 8;
+    if (getObjTag(x) == TAG_STR) ((String*)x)->chars = (char*)((String*)x + 1);
+    if (getObjTag(x) == TAG_TABLE) ((Table*)x)->entries = (TableEntry*)((Table*)x + 1) + 1;
+    if (getObjTag(x) == TAG_VECTOR) ((Vector*)x)->items = (void**)((Vector*)x + 1);
+    if (getObjTag(x) == TAG_F64) ((F64Array*)x)->data = (double*)((F64Array*)x + 1);
+    eachRef(x, (void (*)(void**, void*))relocate, base);
+    at += sizeof(uint64_t) + size;
+  }
+  objAddRoots(base, base + h.size);
+
+  // symbols moved, so identity-keyed tables need their slots recomputed
+  for (uint64_t at = sizeof(ImageHeader); at < h.size;)
+  {
+    void* x = base + at + sizeof(uint64_t);
+    if (getObjTag(x) == TAG_TABLE) tableRehash(x);
+    at += sizeof(uint64_t) + (*((uint64_t*)(base + at)) >> 8);
+  }
+
+  void* root = (void*)h.root;
+  relocate(&root, base);
+  topLevel = root;
+  macroCacheClear();
+  return 1;
+}
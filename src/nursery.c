@@ -0,0 +1,635 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+#define _GNU_SOURCE // pthread_getattr_np
+#include "turtle.h"
+#ifdef TURTLE_NURSERY
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+
+// Generational collector
+// Built instead of bdwgc with TURTLE_NURSERY. The heap is one reserved range cut into
+// blocks. New objects are bump allocated in nursery blocks; a minor collection copies the
+// survivors into old blocks, compacting them in allocation order, and a full collection
+// does the same for the whole heap once the old generation has doubled.
+//
+// Objects are traced precisely from their tags, as is memory from objAllocValues. The
+// C stack, registers, static data and root regions are scanned conservatively, and so is
+// the rest of objAlloc's memory: whatever block an ambiguous word points into is pinned
+// and kept in place, along with everything in it (a mostly-copying collector). Everything
+// is marked before anything moves, so pinning never comes too late. Objects hashed by
+// address are pinned too, since moving them would lose them in their tables.
+//
+// Old blocks are write-protected after each collection. The first store into one faults,
+// and the handler unprotects it and marks it dirty; a minor collection treats the
+// objects of dirty blocks as roots. Pointer-free memory lives in blocks of its own that
+// are never protected, so system calls can read into it.
+//
+// The collector is single-threaded: objThread declines, and par.c runs futures inline.
+#define BLOCK_BITS 15
+#define BLOCK_SIZE ((uint64_t)1 << BLOCK_BITS)
+#define LARGE_SIZE (BLOCK_SIZE / 4) // bigger allocations get blocks of their own and never move
+#define HEAP_RESERVE ((uint64_t)16 << 30)
+#define NURSERY_SIZE ((uint64_t)4 << 20)
+#define NURSERY_MIN (16 * BLOCK_SIZE) // a pinned block is promoted whole, so the nursery needs a few
+#define FULL_MIN ((uint64_t)32 << 20)
+
+// header word: the tag in the low byte, then flags, then the payload size in bytes
+#define HEADER_MARK ((uint64_t)1 << 8)
+#define HEADER_HASHED ((uint64_t)1 << 9)
+#define HEADER_SIZE(h) ((h) >> 16)
+enum { KIND_RAW = 0xfc, KIND_VALUES, KIND_ATOMIC, KIND_FORWARD }; // tags of untagged memory, and of moved objects
+
+enum { BLOCK_FREE, BLOCK_YOUNG, BLOCK_OLD, BLOCK_COPY, BLOCK_IMMORTAL }; // BLOCK_COPY: old, filled by this collection
+enum
+{
+  BLOCK_ATOMIC = 1, BLOCK_LARGE = 2, BLOCK_TAIL = 4, BLOCK_PINNED = 8,
+  BLOCK_DIRTY = 16, BLOCK_PROTECTED = 32, BLOCK_STACKED = 64, BLOCK_RECYCLED = 128
+};
+// used is the allocated part; span is the length of a large object's blocks, or their head for a tail
+typedef struct Block { uint64_t used; uint32_t span; uint8_t space, flags; } Block;
+typedef struct Cursor { char* at, * end; uint64_t block; } Cursor;
+
+static char* heap = NULL;
+static Block* blocks = NULL;
+static uint64_t top = 0, inUse = 0; // blocks below top have been used; inUse are not free
+static uint32_t* freeStack = NULL;
+static uint64_t freeCount = 0, freeCapacity = 0;
+static Cursor young[2], copies[2], immortal; // [1] is for pointer-free memory
+static uint64_t youngBytes = 0, nurserySize = NURSERY_SIZE, fullThreshold = FULL_MIN, maxHeap = 0, divisor = 3;
+static uint8_t fullCollection = 0;
+static uintptr_t stackTop = 0;
+typedef struct RootRegion { uintptr_t start, end; } RootRegion;
+static RootRegion* regions = NULL;
+static uint64_t regionCount = 0;
+static void** markStack = NULL;
+static uint64_t markCount = 0, markCapacity = 0;
+
+// telemetry; every collection is a single pause
+static double gcTime = 0, gcPauseMax = 0, gcPauseLast = 0;
+static uint64_t minorCollections = 0, fullCollections = 0, totalBytes = 0, promotedBytes = 0;
+
+static double seconds()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Blocks //////////////////////////////////////////////////////////////////////////////////////////
+static char* blockAddress(const uint64_t i) { return heap + (i << BLOCK_BITS); }
+static uint64_t blockIndex(const uintptr_t p) { return (p - (uintptr_t)heap) >> BLOCK_BITS; }
+static uint8_t inHeap(const uintptr_t p) { return p - (uintptr_t)heap < top << BLOCK_BITS; }
+static uint64_t spanOf(const uint64_t i) { return (blocks[i].flags & BLOCK_LARGE) ? blocks[i].span : 1; }
+
+// count contiguous blocks, cleared, with the flags going to the first
+static uint64_t takeBlocks(const uint64_t count, const uint8_t space, const uint8_t flags)
+{
+  uint64_t i = top;
+  if (count == 1)
+    while (freeCount)
+    {
+      const uint64_t j = freeStack[--freeCount];
+      blocks[j].flags &= ~BLOCK_STACKED;
+      if (blocks[j].space == BLOCK_FREE) { i = j; break; }
+    }
+  else
+    for (uint64_t j = 0, run = 0; j < top; j++)
+      if ((run = blocks[j].space == BLOCK_FREE ? run + 1 : 0) == count) { i = j + 1 - count; break; }
+  if (i == top)
+  {
+    if ((top + count) << BLOCK_BITS > HEAP_RESERVE) panic("obj(): heap reservation exhausted");
+    top += count;
+  }
+  for (uint64_t j = i; j < i + count; j++)
+  {
+    if (blocks[j].flags & BLOCK_RECYCLED) memset(blockAddress(j), 0, BLOCK_SIZE);
+    const uint8_t stacked = blocks[j].flags & BLOCK_STACKED;
+    blocks[j] = j == i ? (Block){0, count, space, flags | stacked} : (Block){0, i, space, (flags & ~BLOCK_LARGE) | BLOCK_TAIL | stacked};
+  }
+  inUse += count;
+  return i;
+}
+
+static void releaseBlocks(const uint64_t i, const uint64_t count)
+{
+  // a large span goes back to the system, which also leaves it cleared
+  if (count > 1) madvise(blockAddress(i), count << BLOCK_BITS, MADV_DONTNEED);
+  for (uint64_t j = i; j < i + count; j++)
+  {
+    const uint8_t stacked = blocks[j].flags & BLOCK_STACKED;
+    blocks[j] = (Block){0, 0, BLOCK_FREE, (count > 1 ? 0 : BLOCK_RECYCLED) | BLOCK_STACKED};
+    if (stacked) continue;
+    if (freeCount == freeCapacity)
+    {
+      freeCapacity = freeCapacity ? 2 * freeCapacity : 1024;
+      freeStack = realloc(freeStack, freeCapacity * sizeof(uint32_t));
+      if (!freeStack) panic("releaseBlocks(): realloc failed");
+    }
+    freeStack[freeCount++] = j;
+  }
+  inUse -= count;
+}
+
+static void setSpace(const uint64_t i, const uint8_t space)
+{
+  for (uint64_t j = i; j < i + spanOf(i); j++) blocks[j].space = space;
+}
+
+static void retire(Cursor* const c)
+{
+  if (c->at) blocks[c->block].used = c->at - blockAddress(c->block);
+  c->at = c->end = NULL;
+}
+
+static uint64_t* bump(Cursor* const c, const uint64_t bytes, const uint8_t space, const uint8_t flags)
+{
+  if ((uint64_t)(c->end - c->at) < bytes)
+  {
+    retire(c);
+    c->block = takeBlocks(1, space, flags);
+    c->at = blockAddress(c->block);
+    c->end = c->at + BLOCK_SIZE;
+  }
+  uint64_t* mem = (uint64_t*)c->at;
+  c->at += bytes;
+  return mem;
+}
+
+// Write barrier ///////////////////////////////////////////////////////////////////////////////////
+// Each block is protected on its own, large spans included, so a store into a long array
+// dirties only the blocks it touches. Flags change before protecting and after
+// unprotecting, so a fault always finds its block marked protected.
+static void onFault(int sig, siginfo_t* info, void* uc)
+{
+  (void)uc;
+  const uintptr_t p = (uintptr_t)info->si_addr;
+  if (inHeap(p) && (blocks[blockIndex(p)].flags & BLOCK_PROTECTED))
+  {
+    const uint64_t i = blockIndex(p);
+    mprotect(blockAddress(i), BLOCK_SIZE, PROT_READ | PROT_WRITE);
+    blocks[i].flags = (blocks[i].flags & ~BLOCK_PROTECTED) | BLOCK_DIRTY;
+    return;
+  }
+  signal(sig, SIG_DFL); // not ours; fault again without the handler
+}
+
+static void protectOld()
+{
+  for (uint64_t i = 0; i < top;)
+  {
+    uint64_t j = i;
+    for (; j < top && blocks[j].space == BLOCK_OLD && !(blocks[j].flags & (BLOCK_ATOMIC | BLOCK_PROTECTED)); j++)
+      blocks[j].flags = (blocks[j].flags | BLOCK_PROTECTED) & ~BLOCK_DIRTY;
+    if (j > i) mprotect(blockAddress(i), (j - i) << BLOCK_BITS, PROT_READ);
+    i = j > i ? j : i + 1;
+  }
+}
+
+// Marking /////////////////////////////////////////////////////////////////////////////////////////
+static uint8_t from(const Block* const b) { return b->space == BLOCK_YOUNG || (fullCollection && b->space == BLOCK_OLD); }
+
+static void markPush(void* x)
+{
+  if (markCount == markCapacity)
+  {
+    markCapacity = markCapacity ? 2 * markCapacity : 4096;
+    markStack = realloc(markStack, markCapacity * sizeof(void*));
+    if (!markStack) panic("markPush(): realloc failed");
+  }
+  markStack[markCount++] = x;
+}
+
+static void pinBlock(const uint64_t i)
+{
+  Block* b = &blocks[i];
+  if (b->flags & BLOCK_PINNED) return;
+  b->flags |= BLOCK_PINNED;
+  for (uint64_t* h = (uint64_t*)blockAddress(i), * end = (uint64_t*)((char*)h + b->used); h < end; h += 1 + HEADER_SIZE(*h) / 8)
+    if (!(*h & HEADER_MARK))
+    {
+      *h |= HEADER_MARK;
+      if (!(b->flags & BLOCK_ATOMIC)) markPush(h + 1);
+    }
+}
+
+// a reference known to be to the start of an object, or an immediate
+static void markPrecise(void* x)
+{
+  const uintptr_t p = (uintptr_t)x;
+  if ((p & IMM_MASK) || !inHeap(p)) return;
+  const uint64_t i = blockIndex(p);
+  Block* b = &blocks[i];
+  uint64_t* h = (uint64_t*)x - 1;
+  if (!from(b) || (*h & HEADER_MARK)) return;
+  *h |= HEADER_MARK;
+  if (!(b->flags & BLOCK_ATOMIC)) markPush(x);
+  const uint8_t tag = (uint8_t)*h;
+  if (!(b->flags & BLOCK_LARGE) && ((*h & HEADER_HASHED) || tag == KIND_RAW || tag == TAG_FUTURE)) pinBlock(i);
+}
+
+// a word that may or may not point into the heap
+static void markAmbiguous(const uintptr_t p)
+{
+  if (!inHeap(p)) return;
+  uint64_t i = blockIndex(p);
+  if (i && !((p - (uintptr_t)heap) & (BLOCK_SIZE - 1))) markAmbiguous(p - 1); // one past the end of the block before
+  if (blocks[i].flags & BLOCK_TAIL) i = blocks[i].span;
+  Block* b = &blocks[i];
+  if (!from(b)) return;
+  if (!(b->flags & BLOCK_LARGE)) { pinBlock(i); return; }
+  uint64_t* h = (uint64_t*)blockAddress(i);
+  if (*h & HEADER_MARK) return;
+  *h |= HEADER_MARK;
+  if (!(b->flags & BLOCK_ATOMIC)) markPush(h + 1);
+}
+
+// reads every word of the range, including stack words a sanitizer has poisoned
+__attribute__((no_sanitize("address"))) static void markRange(const uintptr_t start, const uintptr_t end)
+{
+  for (const uintptr_t* p = (const uintptr_t*)((start + 7) & ~(uintptr_t)7); (uintptr_t)(p + 1) <= end; p++) markAmbiguous(*p);
+}
+
+// callee-saved registers were spilled into the caller's frame, which is above this one
+static void __attribute__((noinline)) markStackRoots() { markRange((uintptr_t)__builtin_frame_address(0), stackTop); }
+
+static void fixSlot(void** const slot)
+{
+  const uintptr_t p = (uintptr_t)*slot;
+  if ((p & IMM_MASK) || !inHeap(p)) return;
+  const uint64_t* h = (uint64_t*)p - 1;
+  if ((uint8_t)*h == KIND_FORWARD) *slot = (void*)h[1];
+}
+
+// marks what x references, or with fixing set, points its references at moved objects
+static void visit(void* x, const uint8_t fixing)
+{
+#define SLOT(s) (fixing ? fixSlot((void**)(s)) : markPrecise(*(void**)(s)))
+  const uint64_t h = ((uint64_t*)x)[-1];
+  switch ((uint8_t)h)
+  {
+    case TAG_STR: // a slice or a wrapped buffer may point anywhere into its storage
+      if (!fixing && ((String*)x)->chars != (char*)((String*)x + 1)) markAmbiguous((uintptr_t)((String*)x)->chars);
+      return;
+    case TAG_CLSR: SLOT(&((Closure*)x)->lambda); SLOT(&((Closure*)x)->env); return;
+    case TAG_MACRO: SLOT(x); return;
+    case TAG_CONS: SLOT(&((Cons*)x)->car); SLOT(&((Cons*)x)->cdr); return;
+    case TAG_TABLE:
+    {
+      // entries points past the capacity slot at the start of its block
+      void* entries = ((Table*)x)->entries - 1;
+      SLOT(&entries);
+      if (fixing && (TableEntry*)entries + 1 != ((Table*)x)->entries) ((Table*)x)->entries = (TableEntry*)entries + 1;
+      return;
+    }
+    case TAG_FRAME:
+    {
+      Frame* f = (Frame*)x;
+      SLOT(&f->parent);
+      SLOT(&f->names);
+      for (uint64_t i = 0; i < f->count; i++) SLOT(&f->slots[i]);
+      return;
+    }
+    case TAG_REF: SLOT(&((Ref*)x)->sym); return;
+    case TAG_LAMBDA:
+      SLOT(&((Lambda*)x)->params); SLOT(&((Lambda*)x)->body); SLOT(&((Lambda*)x)->code); SLOT(&((Lambda*)x)->name);
+      return;
+    case TAG_VECTOR: SLOT(&((Vector*)x)->items); return;
+    case TAG_F64: SLOT(&((F64Array*)x)->data); return;
+    case KIND_VALUES:
+      for (uint64_t i = 0; i < HEADER_SIZE(h) / 8; i++) SLOT((void**)x + i);
+      return;
+    case KIND_RAW: case TAG_FUTURE:
+      if (!fixing) for (uint64_t i = 0; i < HEADER_SIZE(h) / 8; i++) markAmbiguous(((uintptr_t*)x)[i]);
+      return;
+    default: return;
+  }
+#undef SLOT
+}
+
+// visit each object of a block, clearing marks
+static void visitBlock(const uint64_t i, const uint8_t fixing)
+{
+  const uint8_t scan = !(blocks[i].flags & BLOCK_ATOMIC);
+  for (uint64_t* h = (uint64_t*)blockAddress(i), * end = (uint64_t*)((char*)h + blocks[i].used); h < end; h += 1 + HEADER_SIZE(*h) / 8)
+  {
+    if (fixing) *h &= ~HEADER_MARK;
+    if (scan) visit(h + 1, fixing);
+  }
+}
+
+// A dirty old block is a root of a minor collection. Only the dirty blocks of a large array
+// are visited; any other large object is visited whole, from its first dirty block.
+static void visitDirty(const uint64_t i, const uint8_t fixing)
+{
+  if (!(blocks[i].flags & (BLOCK_LARGE | BLOCK_TAIL))) { visitBlock(i, fixing); return; }
+  const uint64_t head = (blocks[i].flags & BLOCK_TAIL) ? blocks[i].span : i;
+  uint64_t* h = (uint64_t*)blockAddress(head);
+  const uint8_t tag = (uint8_t)*h;
+  if (tag != KIND_VALUES && tag != KIND_RAW)
+  {
+    for (uint64_t j = head; j < i; j++)
+      if (blocks[j].flags & BLOCK_DIRTY) return;
+    visit(h + 1, fixing);
+    return;
+  }
+  void** start = (void**)(h + 1), ** end = (void**)((char*)h + blocks[head].used);
+  if ((char*)start < blockAddress(i)) start = (void**)blockAddress(i);
+  if ((char*)end > blockAddress(i + 1)) end = (void**)blockAddress(i + 1);
+  for (void** p = start; p < end; p++)
+    if (fixing) fixSlot(p);
+    else if (tag == KIND_VALUES) markPrecise(*p);
+    else markAmbiguous((uintptr_t)*p);
+}
+
+// Copying /////////////////////////////////////////////////////////////////////////////////////////
+static void evacuate(const uint64_t i)
+{
+  const uint8_t atomic = blocks[i].flags & BLOCK_ATOMIC;
+  for (uint64_t* h = (uint64_t*)blockAddress(i), * end = (uint64_t*)((char*)h + blocks[i].used); h < end;)
+  {
+    const uint64_t header = *h, bytes = sizeof(uint64_t) + HEADER_SIZE(header);
+    if (header & HEADER_MARK)
+    {
+      uint64_t* to = bump(&copies[atomic], bytes, BLOCK_COPY, atomic);
+      memcpy(to, h, bytes);
+      *to = header & ~HEADER_MARK;
+      const String* s = (String*)(h + 1);
+      if ((uint8_t)header == TAG_STR && s->chars == (char*)(s + 1)) ((String*)(to + 1))->chars = (char*)((String*)(to + 1) + 1);
+      h[0] = KIND_FORWARD;
+      h[1] = (uint64_t)(to + 1);
+      promotedBytes += bytes;
+    }
+    h = (uint64_t*)((char*)h + bytes);
+  }
+}
+
+static void collect(const uint8_t full)
+{
+  const double start = seconds();
+  retire(&young[0]);
+  retire(&young[1]);
+  fullCollection = full;
+  if (full)
+  {
+    mprotect(heap, top << BLOCK_BITS, PROT_READ | PROT_WRITE);
+    for (uint64_t i = 0; i < top; i++) blocks[i].flags &= ~BLOCK_PROTECTED;
+  }
+
+  // roots: the stack and registers, static data, root regions, and in a minor collection dirty old blocks
+  extern char __data_start[], _end[];
+  __builtin_unwind_init();
+  markStackRoots();
+  markRange((uintptr_t)__data_start, (uintptr_t)_end);
+  for (uint64_t i = 0; i < regionCount; i++) markRange(regions[i].start, regions[i].end);
+  if (!full)
+    for (uint64_t i = 0; i < top; i++)
+      if (blocks[i].space == BLOCK_OLD && (blocks[i].flags & BLOCK_DIRTY)) visitDirty(i, 0);
+  while (markCount) visit(markStack[--markCount], 0);
+
+  // copy what was marked and is free to move, then fix references and release the rest
+  const uint64_t count = top;
+  for (uint64_t i = 0; i < count; i++)
+    if (from(&blocks[i]) && !(blocks[i].flags & (BLOCK_PINNED | BLOCK_LARGE | BLOCK_TAIL))) evacuate(i);
+  retire(&copies[0]);
+  retire(&copies[1]);
+  for (uint64_t i = 0; i < top; i++)
+  {
+    Block* b = &blocks[i];
+    if (!full && b->space == BLOCK_OLD && (b->flags & BLOCK_DIRTY)) { visitDirty(i, 1); continue; }
+    if (b->flags & BLOCK_TAIL) continue;
+    if (b->space == BLOCK_COPY)
+    {
+      visitBlock(i, 1);
+      b->space = BLOCK_OLD;
+    }
+    else if (from(b))
+    {
+      const uint8_t live = (b->flags & BLOCK_PINNED) || ((b->flags & BLOCK_LARGE) && (*(uint64_t*)blockAddress(i) & HEADER_MARK));
+      if (!live) { releaseBlocks(i, spanOf(i)); continue; }
+      visitBlock(i, 1);
+      b->flags &= ~BLOCK_PINNED;
+      setSpace(i, BLOCK_OLD);
+    }
+  }
+  protectOld();
+  youngBytes = 0;
+
+  uint64_t old = 0;
+  for (uint64_t i = 0; i < top; i++) old += blocks[i].space == BLOCK_OLD;
+  old <<= BLOCK_BITS;
+  if (full)
+  {
+    fullCollections++;
+    const uint64_t grown = old + 3 * old / divisor;
+    fullThreshold = grown > FULL_MIN ? grown : FULL_MIN;
+  }
+  else minorCollections++;
+  gcPauseLast = seconds() - start;
+  gcTime += gcPauseLast;
+  if (gcPauseLast > gcPauseMax) gcPauseMax = gcPauseLast;
+  if (!full && old > fullThreshold) collect(1);
+}
+
+// Allocation //////////////////////////////////////////////////////////////////////////////////////
+// room for bytes more in the nursery, collecting first if it is full
+static void reserve(const uint64_t bytes)
+{
+  if (youngBytes + bytes > nurserySize) collect(0);
+  if (maxHeap && (inUse << BLOCK_BITS) + bytes > maxHeap)
+  {
+    collect(1);
+    if ((inUse << BLOCK_BITS) + bytes > maxHeap) panic("obj(): heap limit reached");
+  }
+  youngBytes += bytes;
+}
+
+// a cleared object of the given tag, in the nursery unless it is large or immortal
+static void* allocate(const uint8_t tag, uint64_t size, const uint8_t atomic, const uint8_t space)
+{
+  size = size < 8 ? 8 : (size + 7) & ~(uint64_t)7; // room for a forwarding address
+  const uint64_t bytes = sizeof(uint64_t) + size;
+  totalBytes += bytes;
+  uint64_t* mem;
+  if (bytes > LARGE_SIZE)
+  {
+    const uint64_t count = (bytes + BLOCK_SIZE - 1) >> BLOCK_BITS;
+    if (space == BLOCK_YOUNG) reserve(count << BLOCK_BITS);
+    const uint64_t i = takeBlocks(count, space, BLOCK_LARGE | (atomic ? BLOCK_ATOMIC : 0));
+    blocks[i].used = bytes;
+    mem = (uint64_t*)blockAddress(i);
+  }
+  else if (space == BLOCK_IMMORTAL) mem = bump(&immortal, bytes, BLOCK_IMMORTAL, BLOCK_ATOMIC);
+  else
+  {
+    Cursor* c = &young[atomic];
+    if ((uint64_t)(c->end - c->at) < bytes)
+    {
+      retire(c);
+      reserve(BLOCK_SIZE);
+    }
+    mem = bump(c, bytes, BLOCK_YOUNG, atomic ? BLOCK_ATOMIC : 0);
+  }
+  mem[0] = tag | (size << 16);
+  return mem + 1;
+}
+
+void objInit(const GcOptions* const o)
+{
+  heap = mmap(NULL, HEAP_RESERVE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  blocks = calloc(HEAP_RESERVE >> BLOCK_BITS, sizeof(Block));
+  if (heap == MAP_FAILED || !blocks) panic("objInit(): cannot reserve the heap");
+  immortal.block = takeBlocks(1, BLOCK_IMMORTAL, BLOCK_ATOMIC);
+  immortal.at = blockAddress(immortal.block);
+  immortal.end = immortal.at + BLOCK_SIZE;
+  if (o->nursery) nurserySize = o->nursery < NURSERY_MIN ? NURSERY_MIN : o->nursery;
+  if (o->heap > fullThreshold) fullThreshold = o->heap;
+  if (o->maxHeap) maxHeap = o->maxHeap;
+  if (o->divisor) divisor = o->divisor;
+  // markers, incremental and pauseTarget are bdwgc's; the nursery size bounds a pause instead
+
+  pthread_attr_t attr;
+  void* stack;
+  size_t stackSize;
+  if (pthread_getattr_np(pthread_self(), &attr) || pthread_attr_getstack(&attr, &stack, &stackSize))
+    panic("objInit(): cannot find the stack");
+  pthread_attr_destroy(&attr);
+  stackTop = (uintptr_t)stack + stackSize;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = onFault;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, NULL);
+}
+
+void* obj(const uint8_t type, const uint64_t size)
+{
+  STAT(allocs[type], 1);
+  STAT(allocBytes[type], sizeof(uint64_t) + size);
+  switch (type)
+  {
+    case TAG_SYM: case TAG_PRIM: return allocate(type, size, 1, BLOCK_IMMORTAL); // interned and never freed
+    case TAG_NUM: return allocate(type, size, 1, BLOCK_YOUNG);
+    default: return allocate(type, size, 0, BLOCK_YOUNG);
+  }
+}
+
+void* objAtomic(const uint8_t type, const uint64_t size)
+{
+  STAT(allocs[type], 1);
+  STAT(allocBytes[type], sizeof(uint64_t) + size);
+  return allocate(type, size, 1, BLOCK_YOUNG);
+}
+
+void* objAlloc(const uint64_t size)
+{
+  STAT(rawAllocs, 1);
+  STAT(rawBytes, size);
+  return allocate(KIND_RAW, size, 0, BLOCK_YOUNG);
+}
+
+void* objAllocValues(const uint64_t size)
+{
+  STAT(rawAllocs, 1);
+  STAT(rawBytes, size);
+  return allocate(KIND_VALUES, size, 0, BLOCK_YOUNG);
+}
+
+void* objAllocAtomic(const uint64_t size)
+{
+  STAT(rawAllocs, 1);
+  STAT(rawBytes, size);
+  return allocate(KIND_ATOMIC, size, 1, BLOCK_YOUNG);
+}
+
+void objAddRoots(void* start, void* end)
+{
+  regions = realloc(regions, (regionCount + 1) * sizeof(RootRegion));
+  if (!regions) panic("objAddRoots(): realloc failed");
+  regions[regionCount++] = (RootRegion){(uintptr_t)start, (uintptr_t)end};
+}
+
+void objPin(const void* const x)
+{
+  const uintptr_t p = (uintptr_t)x;
+  if ((p & IMM_MASK) || !inHeap(p)) return;
+  uint64_t* h = (uint64_t*)x - 1;
+  if (!(*h & HEADER_HASHED)) *h |= HEADER_HASHED;
+}
+
+uint64_t objBytesAllocated() { return totalBytes; }
+
+uint8_t objThread(void* (*fn)(void*), void* arg, const uint64_t stackSize)
+{
+  (void)fn; (void)arg; (void)stackSize;
+  return 0;
+}
+
+// Primitives //////////////////////////////////////////////////////////////////////////////////////
+
+void* fnGcStats(uint64_t argc, void** argv)
+{
+  if (argc) return symbol("ERROR: gc-stats FAILED; MUST BE OF THE FORM (gc-stats)");
+  const uint64_t collections = minorCollections + fullCollections;
+  const double values[] =
+  {
+    (double)(inUse << BLOCK_BITS), (double)((top - inUse) << BLOCK_BITS), (double)collections, (double)totalBytes,
+    1e3 * gcTime, (double)collections, 1e3 * gcTime, 1e3 * gcPauseMax, 1e3 * gcPauseLast,
+    1, (double)minorCollections, (double)fullCollections, (double)nurserySize, (double)promotedBytes
+  };
+  char* names[] =
+  {
+    "heap-size", "free-bytes", "collections", "bytes-allocated",
+    "gc-time-ms", "pauses", "pause-total-ms", "pause-max-ms", "pause-last-ms",
+    "markers", "minor-collections", "full-collections", "nursery-size", "promoted-bytes"
+  };
+  void* x = cons(cons(symbol("incremental"), nil), nil);
+  for (uint64_t i = sizeof(values) / sizeof(values[0]); i--;) x = cons(cons(symbol(names[i]), number(values[i])), x);
+  return x;
+}
+
+// (gc-collect) collects the whole heap; (gc-collect step) only the nursery
+void* fnGcCollect(uint64_t argc, void** argv)
+{
+  if (argc > 1 || (argc && argv[0] != symbol("step")))
+    return symbol("ERROR: gc-collect FAILED; MUST BE OF THE FORM (gc-collect [step])");
+  const double start = seconds();
+  collect(!argc);
+  return number(1e3 * (seconds() - start));
+}
+
+void* fnGcTune(uint64_t argc, void** argv)
+{
+  char* err = "ERROR: gc-tune FAILED; MUST BE OF THE FORM (gc-tune setting value) "
+    "WITH SETTING nursery, heap, max-heap OR free-space-divisor";
+  if (argc != 2 || getObjTag(argv[1]) != TAG_NUM || numberValue(argv[1]) < 0) return symbol(err);
+  const uint64_t n = (uint64_t)numberValue(argv[1]);
+  if (argv[0] == symbol("nursery")) nurserySize = n < NURSERY_MIN ? NURSERY_MIN : n;
+  else if (argv[0] == symbol("heap")) fullThreshold = n > FULL_MIN ? n : FULL_MIN;
+  else if (argv[0] == symbol("max-heap")) maxHeap = n;
+  else if (argv[0] == symbol("free-space-divisor") && n) divisor = n;
+  else return symbol(err);
+  return argv[1];
+}
+#endif
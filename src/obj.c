@@ -19,43 +19,294 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include "turtle.h"
+#ifndef TURTLE_NURSERY // nursery.c replaces the collector
 #include "../bdwgc/include/gc/gc.h"
+#include "../bdwgc/include/gc/gc_typed.h"
+#include <time.h>
 
-void objInit() { GC_INIT(); }
+// Collector telemetry
+// A pause runs from stopping the world to restarting it. In the default mode a collection
+// is a single pause; in incremental mode marking is spread over allocations and only
+// the final step stops the world, so collection time and pauses are kept apart.
+static double gcStart = 0, gcTime = 0, gcStopped = 0, gcPauseTotal = 0, gcPauseMax = 0, gcPauseLast = 0;
+static uint64_t gcPauses = 0;
 
+static double seconds()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// called by the collector with its lock held
+static void collectionEvent(GC_EventType e)
+{
+  switch (e)
+  {
+    case GC_EVENT_START: gcStart = seconds(); return;
+    case GC_EVENT_END: gcTime += seconds() - gcStart; return;
+    case GC_EVENT_PRE_STOP_WORLD: gcStopped = seconds(); return;
+    case GC_EVENT_POST_START_WORLD:
+      gcPauseLast = seconds() - gcStopped;
+      gcPauseTotal += gcPauseLast;
+      if (gcPauseLast > gcPauseMax) gcPauseMax = gcPauseLast;
+      gcPauses++;
+      return;
+    default: return;
+  }
+}
+
+// Allocation kinds
+// Symbols, numbers and primitives hold no pointers and are allocated atomic, so the
+// collector never scans them. Small fixed layouts get a typed descriptor naming their
+// pointer words, so the header and integer fields are not mistaken for references.
+// Everything else is scanned conservatively.
+static GC_descr descriptors[TAG_COUNT];
+
+// pointers has bit i set when payload word i holds a reference; word 0 of the block is the header
+static void describe(const uint8_t type, const uint64_t words, const uint64_t pointers)
+{
+  GC_word bitmap[1] = {0};
+  for (uint64_t i = 0; i < words; i++)
+    if ((pointers >> i) & 1) GC_set_bit(bitmap, i + 1);
+  descriptors[type] = GC_make_descriptor(bitmap, words + 1);
+}
+
+// Options left at zero keep the collector's defaults, which it takes from its own
+// environment variables: GC_MARKERS, GC_INITIAL_HEAP_SIZE, GC_MAXIMUM_HEAP_SIZE,
+// GC_FREE_SPACE_DIVISOR, GC_ENABLE_INCREMENTAL and GC_PAUSE_TIME_TARGET.
+void objInit(const GcOptions* const o)
+{
+  if (o->markers) GC_set_markers_count(o->markers); // parallel marking threads
+  GC_INIT();
+  GC_set_on_collection_event(collectionEvent);
+  if (o->maxHeap) GC_set_max_heap_size(o->maxHeap);
+  if (o->heap && o->heap > GC_get_heap_size()) GC_expand_hp(o->heap - GC_get_heap_size());
+  if (o->divisor) GC_set_free_space_divisor(o->divisor);
+  if (o->pauseTarget) GC_set_time_limit(o->pauseTarget);
+  if (o->incremental) GC_enable_incremental();
+  describe(TAG_CONS, 2, 0x3);  // car, cdr
+  describe(TAG_CLSR, 2, 0x3);  // lambda, env
+  describe(TAG_MACRO, 1, 0x1); // the (params . body) cons
+  describe(TAG_REF, 2, 0x1);   // sym; depth and slot share the second word
+  describe(TAG_F64, 2, 0x2);   // data
+}
+
+// Object representation
+// Heap objects are preceded by a one word header holding the tag, so the payload keeps the
+// allocator's 8-byte alignment. Values with a low tag bit set are immediates and never
+// touch the heap: integral numbers that a double holds exactly are fixnums, and nil is a
+// constant.
 void* obj(const uint8_t type, const uint64_t size)
 {  
-  void* mem = GC_MALLOC(sizeof(uint8_t) + size);
+  uint64_t* mem;
+  switch (type)
+  {
+    case TAG_SYM: case TAG_NUM: case TAG_PRIM: mem = GC_MALLOC_ATOMIC(sizeof(uint64_t) + size); break;
+    default:
+      mem = descriptors[type] ? GC_MALLOC_EXPLICITLY_TYPED(sizeof(uint64_t) + size, descriptors[type]) : GC_MALLOC(sizeof(uint64_t) + size);
+      break;
+  }
   if (!mem) panic("obj(): GC_MALLOC failed");
-  memcpy(mem, &type, sizeof(uint8_t));
-  return (void*)((uint64_t)mem + sizeof(uint8_t));
+  STAT(allocs[type], 1);
+  STAT(allocBytes[type], sizeof(uint64_t) + size);
+  mem[0] = type;
+  return mem + 1;
+}
+
+// an object whose payload holds no references, or only references into itself;
+// the payload is not cleared
+void* objAtomic(const uint8_t type, const uint64_t size)
+{
+  uint64_t* mem = GC_MALLOC_ATOMIC(sizeof(uint64_t) + size);
+  if (!mem) panic("objAtomic(): GC_MALLOC_ATOMIC failed");
+  STAT(allocs[type], 1);
+  STAT(allocBytes[type], sizeof(uint64_t) + size);
+  mem[0] = type;
+  return mem + 1;
+}
+
+// untagged collected memory for interpreter-internal storage
+void* objAlloc(const uint64_t size)
+{
+  void* mem = GC_MALLOC(size);
+  if (!mem) panic("objAlloc(): GC_MALLOC failed");
+  STAT(rawAllocs, 1);
+  STAT(rawBytes, size);
+  return mem;
+}
+
+// collected memory holding only objects and immediates; bdwgc scans it like any other
+void* objAllocValues(const uint64_t size) { return objAlloc(size); }
+
+// collected memory the collector does not scan; for data that holds no pointers
+void* objAllocAtomic(const uint64_t size)
+{
+  void* mem = GC_MALLOC_ATOMIC(size);
+  if (!mem) panic("objAllocAtomic(): GC_MALLOC_ATOMIC failed");
+  STAT(rawAllocs, 1);
+  STAT(rawBytes, size);
+  return mem;
 }
 
-uint8_t getObjTag(const void* const x) { return *((uint8_t*)((uint64_t)x - sizeof(uint8_t))); }
+// scan memory the collector did not allocate, such as a mapped heap image
+void objAddRoots(void* start, void* end) { GC_add_roots(start, end); }
+
+uint64_t objBytesAllocated() { return GC_get_total_bytes(); }
 
-uint8_t objEqual(const void* const x, const void* const y)
+// start a detached thread that may allocate; returns 0 if it could not be created
+uint8_t objThread(void* (*fn)(void*), void* arg, const uint64_t stackSize)
 {
-  const uint8_t tag = getObjTag(x);
-  if (tag != getObjTag(y)) return 0;
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, stackSize);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  const int err = pthread_create(&thread, &attr, fn, arg);
+  pthread_attr_destroy(&attr);
+  return !err;
+}
+#endif
+
+uint8_t getObjTag(const void* const x)
+{
+  const uintptr_t bits = (uintptr_t)x;
+  if (bits & IMM_FIXNUM) return TAG_NUM;
+  if (bits & IMM_MASK) return TAG_NIL;
+  return (uint8_t)((const uint64_t*)x)[-1];
+}
 
+// equality of objects that hold no other objects
+static uint8_t atomEqual(const void* x, const void* y, const uint8_t tag)
+{
   switch(tag)
   {
-    case TAG_SYM: case TAG_STR: return !strcmp(x, y);
-    case TAG_NUM: return *((double*)x) == *((double*)y); 
+    case TAG_SYM: return x == y; // symbols are interned
+    case TAG_STR: return ((String*)x)->length == ((String*)y)->length && !memcmp(((String*)x)->chars, ((String*)y)->chars, ((String*)x)->length);
+    case TAG_NUM: return numberValue(x) == numberValue(y);
     case TAG_PRIM: return *((uint8_t*)x) == *((uint8_t*)y);
-    case TAG_CLSR: case TAG_MACRO:
-    {
-      Cons* cx = *((Cons**)x);
-      Cons* cy = *((Cons**)y);
-      return objEqual(cx->car, cy->car) && objEqual(cx->cdr, cy->cdr);
-    }
+    case TAG_CLSR: return ((Closure*)x)->lambda == ((Closure*)y)->lambda && ((Closure*)x)->env == ((Closure*)y)->env;
     case TAG_NIL: return 1;
-    case TAG_CONS:
+    case TAG_F64:
     {
-      Cons* cx = (Cons*)x;
-      Cons* cy = (Cons*)y;
-      return objEqual(cx->car, cy->car) && objEqual(cx->cdr, cy->cdr);
+      const F64Array* ax = x, * ay = y;
+      if (ax->count != ay->count) return 0;
+      for (uint64_t i = 0; i < ax->count; i++)
+	if (ax->data[i] != ay->data[i]) return 0;
+      return 1;
     }
     default: return 0;
   }
 }
+
+typedef struct EqualPair { const void* x, * y; } EqualPair;
+
+uint8_t objEqual(const void* x, const void* y)
+{
+  // pairs still to compare are kept on an explicit stack, as printObj does, so nesting
+  // in either the car or the cdr costs no C stack
+  EqualPair inlineStack[64], * stack = inlineStack;
+  uint64_t depth = 0, capacity = sizeof(inlineStack) / sizeof(inlineStack[0]);
+  uint8_t equal = 1;
+  stack[depth++] = (EqualPair){x, y};
+  while (equal && depth)
+  {
+    x = stack[depth - 1].x;
+    y = stack[--depth].y;
+    if (x == y) continue;
+    const uint8_t tag = getObjTag(x);
+    if (tag != getObjTag(y)) { equal = 0; break; }
+
+    // the children to compare; a macro compares the cons it wraps
+    uint64_t count;
+    if (tag == TAG_CONS || tag == TAG_MACRO) count = 2;
+    else if (tag == TAG_VECTOR && ((Vector*)x)->count == ((Vector*)y)->count) count = ((Vector*)x)->count;
+    else
+    {
+      equal = tag != TAG_VECTOR && atomEqual(x, y, tag);
+      continue;
+    }
+    if (depth + count > capacity)
+    {
+      while (depth + count > capacity) capacity *= 2;
+      EqualPair* grown = malloc(capacity * sizeof(EqualPair));
+      if (!grown) panic("objEqual(): malloc failed");
+      memcpy(grown, stack, depth * sizeof(EqualPair));
+      if (stack != inlineStack) free(stack);
+      stack = grown;
+    }
+    if (tag == TAG_VECTOR)
+      for (uint64_t i = count; i--;) stack[depth++] = (EqualPair){((Vector*)x)->items[i], ((Vector*)y)->items[i]};
+    else
+    {
+      const Cons* cx = tag == TAG_CONS ? x : *((Cons**)x), * cy = tag == TAG_CONS ? y : *((Cons**)y);
+      stack[depth++] = (EqualPair){cx->cdr, cy->cdr};
+      stack[depth++] = (EqualPair){cx->car, cy->car};
+    }
+  }
+  if (stack != inlineStack) free(stack);
+  return equal;
+}
+
+// Primitives //////////////////////////////////////////////////////////////////////////////////////
+#ifndef TURTLE_NURSERY
+
+// association list describing the collected heap; sizes in bytes, times in milliseconds
+void* fnGcStats(uint64_t argc, void** argv)
+{
+  if (argc) return symbol("ERROR: gc-stats FAILED; MUST BE OF THE FORM (gc-stats)");
+  const double values[] =
+  {
+    (double)GC_get_heap_size(), (double)GC_get_free_bytes(), (double)GC_get_gc_no(), (double)GC_get_total_bytes(),
+    1e3 * gcTime, (double)gcPauses, 1e3 * gcPauseTotal, 1e3 * gcPauseMax, 1e3 * gcPauseLast,
+    (double)GC_get_parallel() + 1
+  };
+  char* names[] =
+  {
+    "heap-size", "free-bytes", "collections", "bytes-allocated",
+    "gc-time-ms", "pauses", "pause-total-ms", "pause-max-ms", "pause-last-ms",
+    "markers"
+  };
+  void* x = cons(cons(symbol("incremental"), GC_is_incremental_mode() ? truth : nil), nil);
+  for (uint64_t i = sizeof(values) / sizeof(values[0]); i--;) x = cons(cons(symbol(names[i]), number(values[i])), x);
+  return x;
+}
+
+// (gc-collect) runs a full collection; (gc-collect step) does one increment of work.
+// Returns the milliseconds it took.
+void* fnGcCollect(uint64_t argc, void** argv)
+{
+  if (argc > 1 || (argc && argv[0] != symbol("step")))
+    return symbol("ERROR: gc-collect FAILED; MUST BE OF THE FORM (gc-collect [step])");
+  const double start = seconds();
+  if (argc) GC_collect_a_little();
+  else GC_gcollect();
+  return number(1e3 * (seconds() - start));
+}
+
+// change a collector setting while running; returns the value set
+void* fnGcTune(uint64_t argc, void** argv)
+{
+  char* err = "ERROR: gc-tune FAILED; MUST BE OF THE FORM (gc-tune setting value) "
+    "WITH SETTING incremental, heap, max-heap, free-space-divisor OR pause-target";
+  if (argc != 2) return symbol(err);
+  void* v = argv[1];
+  if (argv[0] == symbol("incremental"))
+  {
+    if (getObjTag(v) == TAG_NIL) return symbol("ERROR: gc-tune FAILED; INCREMENTAL MODE CANNOT BE TURNED OFF");
+    GC_enable_incremental();
+    return v;
+  }
+  if (getObjTag(v) != TAG_NUM || numberValue(v) < 0) return symbol(err);
+  const uint64_t n = (uint64_t)numberValue(v);
+  if (argv[0] == symbol("heap"))
+  {
+    if (n > GC_get_heap_size() && !GC_expand_hp(n - GC_get_heap_size())) return symbol("ERROR: gc-tune FAILED; CANNOT GROW THE HEAP");
+  }
+  else if (argv[0] == symbol("max-heap")) GC_set_max_heap_size(n);
+  else if (argv[0] == symbol("free-space-divisor") && n) GC_set_free_space_divisor(n);
+  else if (argv[0] == symbol("pause-target")) GC_set_time_limit(n);
+  else return symbol(err);
+  return v;
+}
+#endif
@@ -0,0 +1,107 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "turtle.h"
+
+// Output
+// Everything the interpreter prints to stdout goes through one buffer, written out with
+// write(2) when it fills and on outFlush. Callers bracket a whole object or printf call
+// with outBegin and outEnd, so output from several threads does not interleave. When
+// stdout is a terminal, outEnd flushes each completed line, as stdio would.
+#define OUT_SIZE (1 << 16)
+static char outBuf[OUT_SIZE];
+static uint64_t outLength = 0;
+static int8_t outLineMode = -1; // unknown until the first write
+static pthread_mutex_t outLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void outDrain(const char* s, uint64_t n)
+{
+  while (n)
+  {
+    const ssize_t written = write(STDOUT_FILENO, s, n);
+    if (written == -1 && errno == EINTR) continue;
+    if (written <= 0) return; // nowhere to write; drop it
+    s += written;
+    n -= written;
+  }
+}
+
+void outBegin() { pthread_mutex_lock(&outLock); }
+
+void outEnd()
+{
+  if (outLineMode == -1) outLineMode = isatty(STDOUT_FILENO);
+  if (outLineMode && memchr(outBuf, '\n', outLength))
+  {
+    outDrain(outBuf, outLength);
+    outLength = 0;
+  }
+  pthread_mutex_unlock(&outLock);
+}
+
+void outFlush()
+{
+  pthread_mutex_lock(&outLock);
+  outDrain(outBuf, outLength);
+  outLength = 0;
+  pthread_mutex_unlock(&outLock);
+}
+
+// the rest are called between outBegin and outEnd
+void outWrite(const char* s, const uint64_t n)
+{
+  if (outLength + n > OUT_SIZE)
+  {
+    outDrain(outBuf, outLength);
+    outLength = 0;
+    if (n > OUT_SIZE / 2) { outDrain(s, n); return; }
+  }
+  memcpy(outBuf + outLength, s, n);
+  outLength += n;
+}
+
+void outChar(const char c)
+{
+  if (outLength == OUT_SIZE)
+  {
+    outDrain(outBuf, outLength);
+    outLength = 0;
+  }
+  outBuf[outLength++] = c;
+}
+
+void outString(const char* s) { outWrite(s, strlen(s)); }
+
+void outNumber(const double n)
+{
+  char buf[32];
+  outWrite(buf, numberFormat(buf, sizeof(buf), n));
+}
+
+void outPointer(const void* p)
+{
+  char buf[2 + 16];
+  uint64_t i = sizeof(buf), x = (uintptr_t)p;
+  do buf[--i] = "0123456789abcdef"[x & 15]; while (x >>= 4);
+  buf[--i] = 'x';
+  buf[--i] = '0';
+  outWrite(buf + i, sizeof(buf) - i);
+}
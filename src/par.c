@@ -0,0 +1,249 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "turtle.h"
+#include <signal.h>
+
+// Futures
+// A future is a call to run on the worker pool. Each thread has a deque of pending futures:
+// it pushes and pops its own at the bottom and other threads steal from the top, so work
+// spreads out while nested futures stay close to their parent. Whoever claims a future
+// first runs it; touching one that nobody has started runs it inline, and a thread waiting
+// on a running future helps with other work in the meantime.
+//
+// Workers share topLevel and the heap with the main thread, so the functions run in
+// parallel are expected not to redefine globals or mutate data other tasks can see.
+// The pool is started on first use with TURTLE_THREADS workers, or one fewer than the
+// number of processors; index 0 belongs to the main thread.
+enum { FUTURE_PENDING, FUTURE_RUNNING, FUTURE_DONE };
+typedef struct Future
+{
+  uint8_t state;
+  void* fn;
+  uint64_t argc;
+  void** argv;
+  void* value;
+  void** out; // a pmap chunk stores fn of each argument here instead of one value
+} Future;
+
+typedef struct Deque { pthread_mutex_t lock; Future** items; uint64_t top, bottom, capacity; } Deque;
+
+#define WORKER_STACK (8 << 20)
+static Deque* deques = NULL;
+static uint64_t workers = 0;
+static uint64_t queued = 0; // futures sitting in any deque
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolCond = PTHREAD_COND_INITIALIZER; // a future was queued or finished
+
+static void wake()
+{
+  pthread_mutex_lock(&poolLock);
+  pthread_cond_broadcast(&poolCond);
+  pthread_mutex_unlock(&poolLock);
+}
+
+static void dequePush(Deque* d, Future* f)
+{
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom == d->capacity)
+  {
+    const uint64_t count = d->bottom - d->top;
+    if (2 * count >= d->capacity) // else slide the live items down
+    {
+      d->capacity = d->capacity ? 2 * d->capacity : 64;
+      Future** items = objAllocValues(d->capacity * sizeof(Future*));
+      if (count) memcpy(items, d->items + d->top, count * sizeof(Future*));
+      d->items = items;
+    }
+    else memmove(d->items, d->items + d->top, count * sizeof(Future*));
+    d->top = 0;
+    d->bottom = count;
+  }
+  d->items[d->bottom++] = f;
+  pthread_mutex_unlock(&d->lock);
+  __atomic_add_fetch(&queued, 1, __ATOMIC_RELEASE);
+  wake();
+}
+
+static Future* dequeTake(Deque* d, const uint8_t steal)
+{
+  Future* f = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->top < d->bottom)
+  {
+    f = steal ? d->items[d->top++] : d->items[--d->bottom];
+    if (d->top == d->bottom) d->top = d->bottom = 0;
+  }
+  pthread_mutex_unlock(&d->lock);
+  if (f) __atomic_sub_fetch(&queued, 1, __ATOMIC_RELEASE);
+  return f;
+}
+
+// this thread's newest future, or else the oldest of another thread's
+static Future* poolTake()
+{
+  const uint64_t self = context->worker;
+  Future* f = dequeTake(&deques[self], 0);
+  for (uint64_t i = 1; !f && i <= workers; i++) f = dequeTake(&deques[(self + i) % (workers + 1)], 1);
+  return f;
+}
+
+static void futureRun(Future* f)
+{
+  uint8_t pending = FUTURE_PENDING;
+  if (!__atomic_compare_exchange_n(&f->state, &pending, FUTURE_RUNNING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+  if (f->out)
+    for (uint64_t i = 0; i < f->argc; i++) f->out[i] = applyArgv(f->fn, 1, &f->argv[i]);
+  else f->value = applyArgv(f->fn, f->argc, f->argv);
+  __atomic_store_n(&f->state, FUTURE_DONE, __ATOMIC_RELEASE);
+  wake();
+}
+
+static void* workerMain(void* arg)
+{
+  // signals go to the main thread; SIGCHLD, blocked everywhere, goes to the job watcher
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+  char base;
+  contextInit(&base, WORKER_STACK)->worker = (uint64_t)(uintptr_t)arg;
+  while (1)
+  {
+    Future* f = poolTake();
+    if (f)
+    {
+      context->stackOverflow = 0;
+      futureRun(f);
+      continue;
+    }
+    pthread_mutex_lock(&poolLock);
+    while (!__atomic_load_n(&queued, __ATOMIC_ACQUIRE)) pthread_cond_wait(&poolCond, &poolLock);
+    pthread_mutex_unlock(&poolLock);
+  }
+  return NULL;
+}
+
+static void poolStart()
+{
+  const char* threads = getenv("TURTLE_THREADS");
+  const long n = threads ? atol(threads) : sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  workers = n < 1 ? 1 : (uint64_t)n;
+  deques = objAlloc((workers + 1) * sizeof(Deque));
+  for (uint64_t i = 0; i <= workers; i++) pthread_mutex_init(&deques[i].lock, NULL);
+  // a worker that fails to start leaves its deque empty; touch still runs everything
+  for (uint64_t i = 1; i <= workers; i++) objThread(workerMain, (void*)(uintptr_t)i, WORKER_STACK);
+}
+
+static Future* future(void* fn, uint64_t argc, void** argv, void** out)
+{
+  pthread_once(&poolOnce, poolStart);
+  STAT(futures, 1);
+  Future* f = (Future*)obj(TAG_FUTURE, sizeof(Future));
+  f->state = FUTURE_PENDING;
+  f->fn = fn;
+  f->argc = argc;
+  f->argv = argv;
+  f->value = nil;
+  f->out = out;
+  return f;
+}
+
+static void* touch(Future* f)
+{
+  futureRun(f);
+  while (__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) != FUTURE_DONE)
+  {
+    Future* g = poolTake();
+    if (g) { futureRun(g); continue; }
+    pthread_mutex_lock(&poolLock);
+    while (__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) != FUTURE_DONE && !__atomic_load_n(&queued, __ATOMIC_ACQUIRE))
+      pthread_cond_wait(&poolCond, &poolLock);
+    pthread_mutex_unlock(&poolLock);
+  }
+  return f->value;
+}
+
+static uint8_t isCallable(const void* const x) { return getObjTag(x) == TAG_PRIM || getObjTag(x) == TAG_CLSR; }
+
+// Primitives //////////////////////////////////////////////////////////////////////////////////////
+
+void* fnFuture(uint64_t argc, void** argv)
+{
+  if (!argc || !isCallable(argv[0])) return symbol("ERROR: future FAILED; MUST BE OF THE FORM (future fn [arg] ...)");
+  void** args = objAllocValues(argc * sizeof(void*)); // argv may be on the caller's stack
+  memcpy(args, argv + 1, (argc - 1) * sizeof(void*));
+  Future* f = future(argv[0], argc - 1, args, NULL);
+  dequePush(&deques[context->worker], f);
+  return f;
+}
+
+// the value of a future, waiting for it if need be; anything else is returned as it is
+void* fnTouch(uint64_t argc, void** argv)
+{
+  if (argc != 1) return symbol("ERROR: touch FAILED; MUST BE OF THE FORM (touch x)");
+  return getObjTag(argv[0]) == TAG_FUTURE ? touch(argv[0]) : argv[0];
+}
+
+// map fn over a list or vector in chunks, one future each; the result has the input's kind
+void* fnPmap(uint64_t argc, void** argv)
+{
+  const uint8_t tag = argc == 2 ? getObjTag(argv[1]) : TAG_NIL;
+  if (argc != 2 || !isCallable(argv[0]) || (tag != TAG_CONS && tag != TAG_VECTOR && tag != TAG_NIL))
+    return symbol("ERROR: pmap FAILED; MUST BE OF THE FORM (pmap fn list-or-vector)");
+
+  uint64_t count;
+  void** items;
+  if (tag == TAG_VECTOR)
+  {
+    count = ((Vector*)argv[1])->count;
+    items = ((Vector*)argv[1])->items;
+  }
+  else
+  {
+    count = consCount(argv[1]);
+    items = objAllocValues((count ? count : 1) * sizeof(void*));
+    uint64_t i = 0;
+    for (void* l = argv[1]; getObjTag(l) == TAG_CONS; l = cdr(l)) items[i++] = car(l);
+  }
+  Vector* out = vector(count, nil);
+  if (!count) return tag == TAG_VECTOR ? (void*)out : nil;
+
+  pthread_once(&poolOnce, poolStart);
+  uint64_t chunks = 4 * (workers + 1);
+  if (chunks > count) chunks = count;
+  const uint64_t size = (count + chunks - 1) / chunks;
+  chunks = (count + size - 1) / size;
+  Future** fs = objAllocValues(chunks * sizeof(Future*));
+  for (uint64_t c = 0; c < chunks; c++)
+  {
+    const uint64_t start = c * size, n = start + size > count ? count - start : size;
+    fs[c] = future(argv[0], n, items + start, out->items + start);
+  }
+  // queued last to first so the owner pops them in order while thieves take the far end
+  for (uint64_t c = chunks - 1; c; c--) dequePush(&deques[context->worker], fs[c]);
+  for (uint64_t c = 0; c < chunks; c++) touch(fs[c]);
+
+  if (tag == TAG_VECTOR) return out;
+  void* l = nil;
+  for (uint64_t i = count; i; i--) l = cons(out->items[i - 1], l);
+  return l;
+}
@@ -0,0 +1,209 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "turtle.h"
+#include <signal.h>
+#include <sys/time.h>
+
+// Names
+// A closure is named after the global it is first bound to, and the anonymous lambdas
+// written inside it after that, as outer/lambda, so both engines report the same names.
+// The name lives on the lambda, which closures made from it share, so it is set once:
+// after (global g f), or for a second closure of the same lambda, the first name stays.
+// Threads define globals and read names concurrently, so it is claimed with a
+// compare-and-swap and read with lambdaNameOf.
+static void nameInner(void* x, char* outer)
+{
+  for (; getObjTag(x) == TAG_CONS; x = ((Cons*)x)->cdr) nameInner(((Cons*)x)->car, outer);
+  if (getObjTag(x) != TAG_LAMBDA || lambdaNameOf(x)) return;
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%s/lambda", outer);
+  lambdaName(x, symbol(buf));
+}
+
+void lambdaName(Lambda* l, char* name)
+{
+  char* unset = NULL;
+  if (__atomic_compare_exchange_n(&l->name, &unset, name, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) nameInner(l->body, name);
+}
+
+// Shadow call stack
+// Each context keeps the names of the closures it is running, outermost first. The
+// sampler reads it from a signal handler on the same thread, so new storage is filled in
+// before it is published and the capacity is raised last.
+void callsGrow(Context* cx)
+{
+  const uint64_t capacity = cx->callCapacity ? 2 * cx->callCapacity : 256;
+  char** calls = objAllocValues(capacity * sizeof(char*));
+  if (cx->callCapacity) memcpy(calls, cx->calls, cx->callCapacity * sizeof(char*));
+  __atomic_store_n(&cx->calls, calls, __ATOMIC_RELEASE);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  __atomic_store_n(&cx->callCapacity, capacity, __ATOMIC_RELEASE);
+}
+
+// Sampling profiler
+// SIGPROF fires on CPU time; the handler copies the interrupted thread's shadow stack
+// into a preallocated buffer as a count followed by that many names. Symbols are never
+// collected, so the buffer needs no scanning. Worker threads block signals, so only the
+// main thread is sampled. profile-stop folds the samples into "outer;inner count" lines,
+// the input format of flamegraph tools.
+#define PROFILE_WORDS (1 << 21)
+#define PROFILE_DEPTH 512 // deeper stacks keep their innermost calls
+static char** samples = NULL;
+static volatile uint64_t sampleWords = 0, sampleCount = 0, sampleDropped = 0;
+static volatile sig_atomic_t profiling = 0;
+
+static void sample(int sig)
+{
+  Context* cx = context;
+  if (!profiling || !cx) return;
+  const uint64_t capacity = __atomic_load_n(&cx->callCapacity, __ATOMIC_ACQUIRE);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  char** calls = __atomic_load_n(&cx->calls, __ATOMIC_ACQUIRE);
+  uint64_t depth = cx->callDepth, from = 0;
+  if (depth > capacity) depth = capacity;
+  if (depth > PROFILE_DEPTH) from = depth - PROFILE_DEPTH;
+  if (sampleWords + 1 + depth - from > PROFILE_WORDS)
+  {
+    sampleDropped++;
+    return;
+  }
+  samples[sampleWords] = (char*)(uintptr_t)(depth - from);
+  memcpy(&samples[sampleWords + 1], calls + from, (depth - from) * sizeof(char*));
+  sampleWords += 1 + depth - from;
+  sampleCount++;
+}
+
+static uint8_t profileTimer(const uint64_t hz)
+{
+  struct itimerval t = {{0, 0}, {0, 0}};
+  if (hz)
+  {
+    t.it_interval.tv_usec = hz > 1000000 ? 1 : 1000000 / hz;
+    t.it_value = t.it_interval;
+  }
+  return !setitimer(ITIMER_PROF, &t, NULL);
+}
+
+// folded stacks, one line per distinct stack; anonymous top-level code is "toplevel"
+static String* profileFold()
+{
+  Table* counts = hashTable(256);
+  uint64_t size = 256;
+  char* line = malloc(size);
+  if (!line) panic("profileFold(): malloc failed");
+  for (uint64_t at = 0; at < sampleWords;)
+  {
+    const uint64_t depth = (uintptr_t)samples[at++];
+    uint64_t length = 0;
+    for (uint64_t i = 0; i < depth; i++, at++)
+    {
+      const char* name = samples[at];
+      if (!name) continue;
+      const uint64_t n = strlen(name);
+      if (length + n + 2 > size)
+      {
+	while (length + n + 2 > size) size *= 2;
+	line = realloc(line, size);
+	if (!line) panic("profileFold(): realloc failed");
+      }
+      if (length) line[length++] = ';';
+      memcpy(line + length, name, n);
+      length += n;
+    }
+    if (!length)
+    {
+      strcpy(line, "toplevel");
+      length = strlen(line);
+    }
+    String* key = stringOf(line, length);
+    void* n = tableRef(counts, key);
+    tableSet(counts, key, number((n ? numberValue(n) : 0) + 1));
+  }
+  free(line);
+
+  // "stack count\n" per entry; a count takes at most 20 digits
+
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < counts->capacity; i++)
+    if (counts->entries[i].key && getObjTag(counts->entries[i].key) == TAG_STR) total += ((String*)counts->entries[i].key)->length + 22;
+  String* out = stringBuffer(total);
+  out->length = 0;
+  for (uint64_t i = 0; i < counts->capacity; i++)
+  {
+    const String* key = counts->entries[i].key;
+    if (!key || getObjTag(key) != TAG_STR) continue; // empty or deleted
+    memcpy(out->chars + out->length, key->chars, key->length);
+    out->length += key->length;
+    out->length += sprintf(out->chars + out->length, " %lu\n", (uint64_t)numberValue(counts->entries[i].v));
+  }
+  return out;
+}
+
+// Primitives //////////////////////////////////////////////////////////////////////////////////////
+
+// start sampling at hz times a second of CPU time, 1000 by default; discards earlier samples
+void* fnProfileStart(uint64_t argc, void** argv)
+{
+  char* err = "ERROR: profile-start FAILED; MUST BE OF THE FORM (profile-start [hz])";
+  if (argc > 1 || (argc && (getObjTag(argv[0]) != TAG_NUM || numberValue(argv[0]) < 1))) return symbol(err);
+  const uint64_t hz = argc ? (uint64_t)numberValue(argv[0]) : 1000;
+  profiling = 0;
+  profileTimer(0);
+  if (!samples)
+  {
+    samples = malloc(PROFILE_WORDS * sizeof(char*));
+    if (!samples) panic("fnProfileStart(): malloc failed");
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sample;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+  }
+  sampleWords = sampleCount = sampleDropped = 0;
+  profiling = 1;
+  if (!profileTimer(hz))
+  {
+    profiling = 0;
+    return symbol("ERROR: profile-start FAILED; COULD NOT START THE TIMER");
+  }
+  return truth;
+}
+
+// stop sampling and write the folded stacks to path, returning the number of samples,
+// or return them as a string when no path is given
+void* fnProfileStop(uint64_t argc, void** argv)
+{
+  char* err = "ERROR: profile-stop FAILED; MUST BE OF THE FORM (profile-stop [path])";
+  if (argc > 1 || (argc && getObjTag(argv[0]) != TAG_STR)) return symbol(err);
+  profileTimer(0);
+  profiling = 0;
+  if (!samples) return argc ? number(0) : (void*)string("");
+  if (sampleDropped) fprintf(stderr, "profile-stop: buffer full, %lu samples dropped\n", sampleDropped);
+  String* folded = profileFold();
+  if (!argc) return folded;
+  FILE* f = fopen(stringCString(argv[0]), "w");
+  if (!f) return symbol("ERROR: profile-stop FAILED; CANNOT OPEN FILE");
+  const uint8_t ok = fwrite(folded->chars, 1, folded->length, f) == folded->length;
+  if (fclose(f) || !ok) return symbol("ERROR: profile-stop FAILED; CANNOT WRITE FILE");
+  return number((double)sampleCount);
+}
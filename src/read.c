@@ -0,0 +1,267 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "turtle.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Reader
+// Regular files are mapped whole; anything else (a terminal, a pipe) is read in large
+// chunks. Tokens are copied into a growable buffer, and lists are built with an explicit
+// stack, so neither token length nor nesting depth is limited.
+#define READ_CHUNK (1 << 16)
+
+enum { TKN_EOF, TKN_OPEN, TKN_CLOSE, TKN_QUOTE, TKN_DOT, TKN_STR, TKN_ATOM };
+
+typedef struct ParseFrame { void* head; Cons* tail; char close; uint8_t state; } ParseFrame;
+enum { FRAME_LIST, FRAME_DOT, FRAME_TAIL, FRAME_QUOTE }; // ParseFrame.state
+
+struct Reader
+{
+  int fd;
+  uint8_t mapped, eof;
+  char* buf;
+  uint64_t pos, len, capacity;
+  char* token;
+  uint64_t tokenLen, tokenCapacity;
+  char bracket;       // bracket character of the last TKN_OPEN or TKN_CLOSE
+  ParseFrame* stack;  // collected memory; holds partially read lists
+  uint64_t depth, stackCapacity;
+};
+
+static Reader* reader(int fd)
+{
+  Reader* r = objAlloc(sizeof(Reader));
+  memset(r, 0, sizeof(Reader));
+  r->fd = fd;
+  r->tokenCapacity = 256;
+  r->token = malloc(r->tokenCapacity);
+  if (!r->token) panic("reader(): malloc failed");
+
+  struct stat st;
+  if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+  {
+    void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mem != MAP_FAILED)
+    {
+      madvise(mem, st.st_size, MADV_SEQUENTIAL);
+      r->buf = mem;
+      r->len = r->capacity = st.st_size;
+      r->mapped = r->eof = 1;
+      return r;
+    }
+  }
+  r->capacity = READ_CHUNK;
+  r->buf = malloc(r->capacity);
+  if (!r->buf) panic("reader(): malloc failed");
+  return r;
+}
+
+Reader* readerStdin() { return reader(STDIN_FILENO); }
+
+Reader* readerOpen(const char* path)
+{
+  int fd = open(path, O_RDONLY);
+  return fd == -1 ? NULL : reader(fd);
+}
+
+void readerClose(Reader* r)
+{
+  if (r->mapped) munmap(r->buf, r->capacity); else free(r->buf);
+  free(r->token);
+  if (r->fd != STDIN_FILENO) close(r->fd);
+}
+
+static int peekChar(Reader* r)
+{
+  if (r->pos < r->len) return (uint8_t)r->buf[r->pos];
+  if (r->eof) return EOF;
+  ssize_t n;
+  do n = read(r->fd, r->buf, r->capacity); while (n == -1 && errno == EINTR);
+  if (n <= 0) { r->eof = 1; return EOF; }
+  r->pos = 0;
+  r->len = n;
+  return (uint8_t)r->buf[0];
+}
+
+static void tokenPush(Reader* r, const char c)
+{
+  if (r->tokenLen + 1 >= r->tokenCapacity)
+  {
+    r->tokenCapacity *= 2;
+    r->token = realloc(r->token, r->tokenCapacity);
+    if (!r->token) panic("tokenPush(): realloc failed");
+  }
+  r->token[r->tokenLen++] = c;
+}
+
+static uint8_t isBracket(const int c) { return c == '(' || c == ')' || c == '[' || c == ']'; }
+
+static uint8_t nextToken(Reader* r)
+{
+  int c;
+  while (1) // skip blanks and ; comments
+  {
+    while ((c = peekChar(r)) != EOF && c <= ' ') r->pos++;
+    if (c != ';') break;
+    while ((c = peekChar(r)) != EOF && c != '\n') r->pos++;
+  }
+  r->tokenLen = 0;
+  if (c == EOF) return TKN_EOF;
+  r->pos++;
+  switch (c)
+  {
+    case '(': case '[': r->bracket = c; return TKN_OPEN;
+    case ')': case ']': r->bracket = c; return TKN_CLOSE;
+    case '\'': return TKN_QUOTE;
+    case '"':
+      while ((c = peekChar(r)) != EOF && c != '"' && c != '\n') { tokenPush(r, c); r->pos++; }
+      if (c == '"') r->pos++;
+      else fprintf(stderr, "nextToken: missing closing double quote\n");
+      r->token[r->tokenLen] = '\0';
+      return TKN_STR;
+    default:
+      tokenPush(r, c);
+      while ((c = peekChar(r)) != EOF && c > ' ' && c != ';' && !isBracket(c)) { tokenPush(r, c); r->pos++; }
+      r->token[r->tokenLen] = '\0';
+      return strcmp(r->token, ".") ? TKN_ATOM : TKN_DOT;
+  }
+}
+
+// Number scanner: [+-]? (digits [. digits?] | . digits) ([eE] [+-]? digits)?
+// Short integers are converted directly; everything else goes to strtod for correct
+// rounding once the token is known to be a number, so s must be NUL-terminated.
+uint8_t scanNumber(const char* s, const uint64_t len, double* n)
+{
+  uint64_t i = 0, digits = 0, intDigits = 0;
+  uint8_t negative = 0, integral = 1;
+  int64_t v = 0;
+  if (s[i] == '+' || s[i] == '-') negative = s[i++] == '-';
+  for (; i < len && s[i] >= '0' && s[i] <= '9'; i++, digits++, intDigits++)
+    if (intDigits < 18) v = 10 * v + (s[i] - '0');
+  if (i < len && s[i] == '.')
+  {
+    integral = 0;
+    for (i++; i < len && s[i] >= '0' && s[i] <= '9'; i++) digits++;
+  }
+  if (!digits) return 0;
+  if (i < len && (s[i] == 'e' || s[i] == 'E'))
+  {
+    integral = 0;
+    i++;
+    if (i < len && (s[i] == '+' || s[i] == '-')) i++;
+    uint64_t expDigits = 0;
+    for (; i < len && s[i] >= '0' && s[i] <= '9'; i++) expDigits++;
+    if (!expDigits) return 0;
+  }
+  if (i != len) return 0;
+
+  if (integral && intDigits <= 15) *n = negative ? -(double)v : (double)v;
+  else *n = strtod(s, NULL);
+  return 1;
+}
+
+static void* atom(Reader* r)
+{
+  double n;
+  return scanNumber(r->token, r->tokenLen, &n) ? number(n) : symbol(r->token);
+}
+
+static void pushFrame(Reader* r, const char close, const uint8_t state)
+{
+  if (r->depth == r->stackCapacity)
+  {
+    const uint64_t capacity = r->stackCapacity ? 2 * r->stackCapacity : 32;
+    ParseFrame* stack = objAlloc(capacity * sizeof(ParseFrame));
+    if (r->depth) memcpy(stack, r->stack, r->depth * sizeof(ParseFrame));
+    r->stack = stack;
+    r->stackCapacity = capacity;
+  }
+  r->stack[r->depth++] = (ParseFrame){nil, NULL, close, state};
+}
+
+// Read one datum; returns NULL at the end of input.
+void* readForm(Reader* r)
+{
+  r->depth = 0;
+  while (1)
+  {
+    void* x;
+    ParseFrame* top = r->depth ? &r->stack[r->depth - 1] : NULL;
+    const uint8_t tkn = nextToken(r);
+
+    // a dotted tail is complete; the next token closes the list whatever it is
+    if (top && top->state == FRAME_TAIL && tkn != TKN_EOF)
+    {
+      x = top->head;
+      r->depth--;
+    }
+    else switch (tkn)
+    {
+      case TKN_EOF:
+	if (r->depth) fprintf(stderr, "readForm: unexpected end of input\n");
+	return NULL;
+      case TKN_OPEN: pushFrame(r, r->bracket == '(' ? ')' : ']', FRAME_LIST); continue;
+      case TKN_QUOTE: pushFrame(r, 0, FRAME_QUOTE); continue;
+      case TKN_CLOSE:
+	if (top && top->state == FRAME_LIST && top->close == r->bracket)
+	{
+	  x = top->head;
+	  r->depth--;
+	}
+	else
+	{
+	  char name[2] = {r->bracket, '\0'};
+	  x = symbol(name);
+	}
+	break;
+      case TKN_DOT:
+	if (top && top->state == FRAME_LIST) { top->state = FRAME_DOT; continue; }
+	x = symbol(".");
+	break;
+      case TKN_STR: x = stringOf(r->token, r->tokenLen); break;
+      default: x = atom(r); break;
+    }
+
+    // hand the datum to the enclosing frames
+    while (1)
+    {
+      if (!r->depth) return x;
+      top = &r->stack[r->depth - 1];
+      if (top->state == FRAME_QUOTE)
+      {
+	x = cons(symbol("quote"), cons(x, nil));
+	r->depth--;
+	continue;
+      }
+      if (top->state == FRAME_DOT)
+      {
+	if (top->tail) top->tail->cdr = x; else top->head = x;
+	top->state = FRAME_TAIL;
+	break;
+      }
+      Cons* c = cons(x, nil);
+      if (top->tail) top->tail->cdr = c; else top->head = c;
+      top->tail = c;
+      break;
+    }
+  }
+}
@@ -18,50 +18,394 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 */
 
+#define _GNU_SOURCE // pipe2, strchrnul
 #include "turtle.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/stat.h>
 
-static pid_t frk()
+// Commands are started with posix_spawn, which does not copy the page tables of a large
+// heap the way fork does. Command names are resolved against PATH once and cached; the
+// cache is dropped when PATH changes, and an entry is looked up again when the file it
+// names is no longer executable. Names found through a relative PATH entry are not cached
+// since they depend on the working directory.
+extern char** environ;
+
+static Table* commandCache = NULL;
+static char* commandCachePath = NULL;
+static pthread_mutex_t commandLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint8_t isExecutable(const char* path)
+{
+  struct stat st;
+  return !access(path, X_OK) && !stat(path, &st) && S_ISREG(st.st_mode);
+}
+
+// full path of a command, or NULL if PATH has no executable by that name
+static char* commandLookup(char* name)
+{
+  const char* path = getenv("PATH");
+  if (!path) path = "/bin:/usr/bin";
+  if (!commandCache || strcmp(path, commandCachePath))
+  {
+    commandCache = hashTable(64);
+    commandCachePath = stringCString(string((char*)path));
+  }
+  String* key = string(name);
+  String* cached = tableRef(commandCache, key);
+  if (cached && isExecutable(cached->chars))
+  {
+    STAT(commandCacheHits, 1);
+    return cached->chars;
+  }
+
+  const uint64_t nameLen = strlen(name);
+  for (const char* dir = path;; dir++)
+  {
+    const char* dirEnd = strchrnul(dir, ':');
+    const uint64_t dirLen = dirEnd - dir;
+    char* full = objAllocAtomic(dirLen + nameLen + 3);
+    if (dirLen) { memcpy(full, dir, dirLen); full[dirLen] = '/'; strcpy(full + dirLen + 1, name); }
+    else { full[0] = '.'; full[1] = '/'; strcpy(full + 2, name); } // an empty entry is the working directory
+    if (isExecutable(full))
+    {
+      if (dirLen && dir[0] == '/') tableSet(commandCache, key, string(full));
+      return full;
+    }
+    if (!*dirEnd) return NULL;
+    dir = dirEnd;
+  }
+}
+
+static char* resolveCommand(char* name)
+{
+  if (strchr(name, '/')) return name;
+  pthread_mutex_lock(&commandLock);
+  char* full = commandLookup(name);
+  pthread_mutex_unlock(&commandLock);
+  return full;
+}
+
+// start args with stdin, stdout and stderr redirected to in, out and err unless they are
+// -1; returns the pid or -1. Descriptors the child should not keep must be close-on-exec.
+static pid_t spawn(char** args, const int in, const int out, const int err)
+{
+  char* path = args[0] ? resolveCommand(args[0]) : NULL;
+  if (!path) return -1;
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t none;
+  sigemptyset(&none);
+  posix_spawnattr_setsigmask(&attr, &none); // SIGCHLD is blocked in every thread
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+  if (in != -1) posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+  if (out != -1) posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+  if (err != -1) posix_spawn_file_actions_adddup2(&actions, err, STDERR_FILENO);
+  outFlush(); // keep our output ahead of the child's
+  STAT(spawns, 1);
+  pid_t pid;
+  const int failed = posix_spawn(&pid, path, &actions, &attr, args, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  return failed ? -1 : pid;
+}
+
+// exit status the way a shell reports it: 128 plus the signal for a killed process, and
+// 127 for one that could not be started
+static int exitStatus(const int status) { return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status); }
+
+static int waitStatus(const pid_t pid)
+{
+  if (pid == -1) return 127;
+  int status;
+  while (waitpid(pid, &status, 0) == -1)
+    if (errno != EINTR) return 127;
+  return exitStatus(status);
+}
+
+static uint8_t waitSuccess(const pid_t pid) { return !waitStatus(pid); }
+
+char** parseExecArgs(const String* s);
+
+// Start the commands argv[0..argc) with each one's stdout piped into the next one's stdin.
+// The last writes to out and all of them to err; -1 inherits ours.
+static void pipeline(uint64_t argc, void** argv, const int out, const int err, pid_t* pids)
+{
+  int in = -1;
+  for (uint64_t i = 0; i < argc; i++)
+  {
+    int fds[2] = {-1, out};
+    if (i + 1 < argc && pipe2(fds, O_CLOEXEC) == -1) panic("pipeline(); pipe2() failed");
+    pids[i] = spawn(parseExecArgs(argv[i]), in, fds[1], err);
+    if (in != -1) close(in);
+    if (i + 1 < argc) close(fds[1]);
+    in = fds[0];
+  }
+}
+
+// Jobs
+// Background commands are kept in a job table, which futures running on worker threads
+// use as well as the main thread. SIGCHLD is blocked in every thread: jobsInit blocks it
+// before any thread starts, and threads inherit the mask. A watcher thread takes it with
+// sigwait, reaps the finished jobs so that they never linger as zombies, and wakes the
+// threads waiting on jobCond. The table is read, changed and reaped only with jobLock held,
+// by whichever thread holds it, and only pids in the table are waited on, so run, pipe and
+// capture keep the statuses of their own commands.
+typedef struct Job { pid_t pid; int done, status; String* command; } Job;
+static Job* jobs = NULL;
+static uint64_t jobCount = 0, jobCapacity = 0;
+static pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobCond = PTHREAD_COND_INITIALIZER;
+static sigset_t childSet;
+
+void jobsInit()
+{
+  sigemptyset(&childSet);
+  sigaddset(&childSet, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &childSet, NULL);
+}
+
+static void jobsReap();
+
+// only stores integers into the table, which the collector never moves (objAlloc memory is pinned)
+static void* jobWatcher(void* arg)
+{
+  (void)arg;
+  for (int sig;;)
+  {
+    if (sigwait(&childSet, &sig)) continue;
+    pthread_mutex_lock(&jobLock);
+    jobsReap();
+    pthread_cond_broadcast(&jobCond);
+    pthread_mutex_unlock(&jobLock);
+  }
+  return NULL;
+}
+
+static void jobWatcherStart()
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 1 << 16);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, jobWatcher, NULL)) panic("jobWatcherStart(): pthread_create failed");
+  pthread_attr_destroy(&attr);
+}
+
+// with jobLock held
+static void jobsReap()
+{
+  for (uint64_t i = 0; i < jobCount; i++)
+  {
+    int status;
+    if (!jobs[i].done && waitpid(jobs[i].pid, &status, WNOHANG) == jobs[i].pid)
+    {
+      jobs[i].status = exitStatus(status);
+      jobs[i].done = 1;
+    }
+  }
+}
+
+// takes jobLock and reaps the jobs that have finished
+static void jobsLock()
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, jobWatcherStart);
+  pthread_mutex_lock(&jobLock);
+  jobsReap();
+}
+
+static void jobsUnlock() { pthread_mutex_unlock(&jobLock); }
+
+// with jobLock held: sleeps until a child exits, then reaps; indices may have changed
+static void jobsWait()
+{
+  pthread_cond_wait(&jobCond, &jobLock);
+  jobsReap();
+}
+
+// with jobLock held
+static void jobAdd(const pid_t pid, String* command)
+{
+  if (jobCount == jobCapacity)
+  {
+    jobCapacity = jobCapacity ? 2 * jobCapacity : 16;
+    Job* grown = objAlloc(jobCapacity * sizeof(Job));
+    if (jobCount) memcpy(grown, jobs, jobCount * sizeof(Job));
+    jobs = grown;
+  }
+  jobs[jobCount] = (Job){pid, 0, 0, command};
+  jobCount++;
+}
+
+static int64_t jobFind(const pid_t pid)
+{
+  for (uint64_t i = 0; i < jobCount; i++)
+    if (jobs[i].pid == pid) return i;
+  return -1;
+}
+
+static void jobRemove(const uint64_t i) { jobs[i] = jobs[--jobCount]; }
+
+// pid named by a job argument, or -1
+static pid_t jobPid(const void* const x)
+{
+  if (getObjTag(x) != TAG_NUM) return -1;
+  const double n = numberValue(x);
+  return (n > 0 && n <= INT32_MAX && n == (double)(pid_t)n) ? (pid_t)n : -1;
+}
+
+// ((pid command status) ...) where status is () while the job runs
+void* fnJobs(uint64_t argc, void** argv)
+{
+  if (argc) return symbol("ERROR: jobs FAILED; MUST BE OF THE FORM (jobs)");
+  jobsLock();
+  void* x = nil;
+  for (uint64_t i = jobCount; i; i--)
+  {
+    const Job* j = &jobs[i - 1];
+    x = cons(cons(number(j->pid), cons(j->command, cons(j->done ? number(j->status) : nil, nil))), x);
+  }
+  jobsUnlock();
+  return x;
+}
+
+// waits for a job to finish and forgets it; returns its exit status
+void* fnJobWait(uint64_t argc, void** argv)
 {
-  pid_t pid = fork();
-  if (pid == -1) panic("frk() failed");
-  return pid;
+  if (argc != 1) return symbol("ERROR: job-wait FAILED; MUST BE OF THE FORM (job-wait pid)");
+  const pid_t pid = jobPid(argv[0]);
+  jobsLock();
+  int64_t i = jobFind(pid);
+  while (i >= 0 && !jobs[i].done)
+  {
+    jobsWait();
+    i = jobFind(pid); // another thread may have waited for it
+  }
+  if (i < 0)
+  {
+    jobsUnlock();
+    return symbol("ERROR: job-wait FAILED; NO SUCH JOB");
+  }
+  const int status = jobs[i].status;
+  jobRemove(i);
+  jobsUnlock();
+  return number(status);
 }
 
-void* fnCd(void* argList, void* env)
+void* fnJobKill(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: job-kill FAILED; MUST BE OF THE FORM (job-kill pid [signal-number])";
+  if (argc < 1 || argc > 2 || (argc == 2 && getObjTag(argv[1]) != TAG_NUM)) return symbol(err);
+  const pid_t pid = jobPid(argv[0]);
+  const int sig = argc == 2 ? (int)numberValue(argv[1]) : SIGTERM;
+  jobsLock();
+  const int64_t i = jobFind(pid);
+  const uint8_t ok = i >= 0 && !jobs[i].done && !kill(pid, sig);
+  jobsUnlock();
+  return ok ? truth : nil;
+}
+
+// the positive integer a max-jobs argument names, or 0
+static uint64_t jobLimit(const void* const x)
+{
+  if (getObjTag(x) != TAG_NUM) return 0;
+  const double n = numberValue(x);
+  return (n >= 1 && n <= UINT32_MAX && n == (double)(uint64_t)n) ? (uint64_t)n : 0;
+}
+
+// Runs the commands with at most n of them at a time and returns their exit statuses in
+// order. The commands are jobs while they run.
+void* fnRunParallel(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: run-parallel FAILED; MUST BE OF THE FORM (run-parallel max-jobs arg-string ...)";
+  if (argc < 2 || !jobLimit(argv[0])) return symbol(err);
+  for (uint64_t i = 1; i < argc; i++)
+    if (getObjTag(argv[i]) != TAG_STR) return symbol(err);
+  const uint64_t n = jobLimit(argv[0]), count = argc - 1;
+  void** cmds = argv + 1;
+  pid_t pids[count];
+  int statuses[count];
+
+  jobsLock();
+  uint64_t next = 0, running = 0, finished = 0;
+  while (finished < count)
+  {
+    for (; running < n && next < count; next++)
+    {
+      pids[next] = spawn(parseExecArgs(cmds[next]), -1, -1, -1);
+      if (pids[next] == -1) { statuses[next] = 127; finished++; }
+      else { jobAdd(pids[next], cmds[next]); running++; }
+    }
+    uint8_t collected = 0;
+    for (uint64_t k = 0; k < next; k++)
+    {
+      if (pids[k] == -1) continue;
+      const int64_t i = jobFind(pids[k]);
+      if (i < 0 || !jobs[i].done) continue;
+      statuses[k] = jobs[i].status;
+      jobRemove(i);
+      pids[k] = -1;
+      running--;
+      finished++;
+      collected = 1;
+    }
+    if (!collected && running) jobsWait();
+  }
+  jobsUnlock();
+
+  void* x = nil;
+  for (uint64_t k = count; k; k--) x = cons(number(statuses[k - 1]), x);
+  return x;
+}
+
+void* fnCd(uint64_t argc, void** argv)
 {
   char* err =  "ERROR: cd FAILED; MUST BE OF THE FORM (cd string)";
-  if (consCount(argList) != 1) return symbol(err);
-  char* str = eval(car(argList), env);
+  if (argc != 1) return symbol(err);
+  String* str = argv[0];
   if (getObjTag(str) != TAG_STR) return symbol(err);
-  return chdir(str) ? nil : str;
+  return chdir(stringCString(str)) ? nil : str;
 }
 
-void* fnCwd(void* argList, void* env)
+void* fnCwd(uint64_t argc, void** argv)
 {
   char* err =  "ERROR: cwd FAILED; MUST BE OF THE FORM (cwd)";
-  if (consCount(argList)) return symbol(err);
+  if (argc) return symbol(err);
 
   // glibc extends POSIX; getcwd will allocate the memory if you give it the appropriate args
   char* buf = getcwd(NULL, 0);
-  char* x = buf ? string(buf) : nil; 
+  String* x = buf ? string(buf) : nil; 
   free(buf);
   return x;
 }
 
-char** parseExecArgs(char* str)
+char** parseExecArgs(const String* s)
 {
+  // strtok_r writes into the string, so split a private copy; futures may call this on
+  // several threads at once, which rules out strtok's hidden state
+  char* str = objAllocAtomic(s->length + 1);
+  memcpy(str, s->chars, s->length);
+  str[s->length] = '\0';
+
+  // the vector is collected memory so that it keeps the copy alive
   uint64_t capacity = 32, size = 0;
-  char** execArgs = malloc(capacity * sizeof(char*));
-  if (!execArgs) panic("fnRun(): malloc failed");
-  char* delim = " \t\n\r\f\v";
+  char** execArgs = objAlloc(capacity * sizeof(char*));
+  char* delim = " \t\n\r\f\v", * save;
   uint8_t reachedEnd = 0;
-  for (char* tkn = strtok(str, delim); !reachedEnd; tkn = strtok(NULL, delim))
+  for (char* tkn = strtok_r(str, delim, &save); !reachedEnd; tkn = strtok_r(NULL, delim, &save))
   {
     if (size + 1 > capacity)
       {
+	char** grown = objAlloc(capacity * 8 * sizeof(char*));
+	memcpy(grown, execArgs, capacity * sizeof(char*));
+	execArgs = grown;
 	capacity *= 8;
-	execArgs = realloc(execArgs, capacity * sizeof(char*));
-	if (!execArgs) panic("fnRun(): realloc failed");
       }
     execArgs[size++] = tkn;
     if (!tkn) reachedEnd = 1; // stop when we store all the tokens and the NULL-terminator into the arg list
@@ -69,114 +413,135 @@ char** parseExecArgs(char* str)
   return execArgs;
 }
 
-void* fnRun(void* argList, void* env)
+void* fnRun(uint64_t argc, void** argv)
 {
   char* err =  "ERROR: run FAILED; MUST BE OF THE FORM (run arg-string ...)";
-  if (consCount(argList) < 1) return symbol(err);
+  if (argc < 1) return symbol(err);
   uint8_t allSuccess = 1;
-  for (void* l = evalList(argList, env); getObjTag(l) != TAG_NIL; l = cdr(l))
+  for (uint64_t i = 0; i < argc; i++)
   {
-    char* x = car(l);
+    String* x = argv[i];
     if (getObjTag(x) != TAG_STR) return symbol(err);
-
-    // child
-    if (!frk())
-    {
-      char** execArgs = parseExecArgs(x);
-      execvp(execArgs[0], execArgs);
-      free(execArgs);
-      exit(EXIT_FAILURE);
-    }
-
-    // parent
-    {
-      int status;
-      if (wait(&status) == -1) panic("fnRun(); wait() failed");
-      if (WIFEXITED(status)) { if(WEXITSTATUS(status)) allSuccess = 0; }
-    }
+    if (!waitSuccess(spawn(parseExecArgs(x), -1, -1, -1))) allSuccess = 0;
   }
   return allSuccess ? truth : nil;
 }
 
-void* fnDaemon(void* argList, void* env)
+void* fnDaemon(uint64_t argc, void** argv)
 {
   char* err =  "ERROR: daemon FAILED; MUST BE OF THE FORM (daemon arg-string)";
-  if (consCount(argList) != 1) return symbol(err);
-  char* x = eval(car(argList), env);
+  if (argc != 1) return symbol(err);
+  String* x = argv[0];
   if (getObjTag(x) != TAG_STR) return symbol(err);
-  if (!frk())
-  {
-    char** execArgs = parseExecArgs(x);
-    execvp(execArgs[0], execArgs);
-    exit(EXIT_FAILURE);
-  }
-  return truth;
+  jobsLock();
+  const pid_t pid = spawn(parseExecArgs(x), -1, -1, -1);
+  if (pid != -1) jobAdd(pid, x);
+  jobsUnlock();
+  return pid == -1 ? nil : number(pid);
 }
 
-uint8_t pipeHelper(void* evalArgList, char** execArgsOut)
+void* fnPipe(uint64_t argc, void** argv)
 {
-  int pipefd[2];
-  evalArgList = cdr(evalArgList);
-  const uint8_t isChild = (getObjTag(evalArgList) != TAG_NIL) ? 1 : 0;
-  if (isChild)
-    if (pipe(pipefd) == -1) panic("fnPipe(); pipe() failed");
+  char* err =  "ERROR: pipe FAILED; MUST BE OF THE FORM (pipe arg-string-1 arg-string-2 ...)";
+  if (argc < 2) return symbol(err);
+  for (uint64_t i = 0; i < argc; i++)
+    if (getObjTag(argv[i]) != TAG_STR) return symbol(err);
 
-  // child 1
-  if (!frk())
-  {
-    if (isChild)
-    {
-      close(STDOUT_FILENO);
-      dup(pipefd[1]);
-      close(pipefd[0]);
-      close(pipefd[1]);
-    }
-    execvp(execArgsOut[0], execArgsOut);
-    exit(EXIT_FAILURE);
-  }
+  pid_t pids[argc];
+  uint8_t allSuccess = 1;
+  pipeline(argc, argv, -1, -1, pids);
+  for (uint64_t i = 0; i < argc; i++)
+    if (!waitSuccess(pids[i])) allSuccess = 0;
+  return allSuccess ? truth : nil;
+}
+
+// Capture
+// Output is read in large chunks straight into a growing collected buffer, which becomes
+// the string without another copy. stdout and stderr are drained together so that
+// neither pipe can fill up and stall the command.
+#define CAPTURE_CHUNK (1 << 16)
+typedef struct Capture { int fd; char* buf; uint64_t length, capacity; } Capture;
 
-  // child 2
-  if (isChild && !frk())
+// read what is available; returns 0 at end of file
+static uint8_t captureRead(Capture* c)
+{
+  if (c->capacity - c->length < CAPTURE_CHUNK + 1)
   {
-    close(STDIN_FILENO);
-    dup(pipefd[0]);
-    close(pipefd[0]);
-    close(pipefd[1]);
-    char** execArgsIn = parseExecArgs(car(evalArgList));
-    pipeHelper(evalArgList, execArgsIn) ? exit(EXIT_SUCCESS) : exit(EXIT_FAILURE);
+    const uint64_t capacity = c->capacity ? 2 * c->capacity : CAPTURE_CHUNK + 1;
+    char* buf = objAllocAtomic(capacity);
+    if (c->length) memcpy(buf, c->buf, c->length);
+    c->buf = buf;
+    c->capacity = capacity;
   }
-    
-  // parent
-  uint8_t allSuccess = 1;
+  ssize_t n;
+  do n = read(c->fd, c->buf + c->length, c->capacity - c->length - 1); while (n == -1 && errno == EINTR);
+  if (n <= 0) return 0;
+  c->length += n;
+  return 1;
+}
+
+static String* captureString(Capture* c)
+{
+  if (!c->buf) return stringOf("", 0);
+  c->buf[c->length] = '\0';
+  return stringWrap(c->buf, c->length);
+}
+
+// run the pipeline argv[0..argc) and collect its stdout, and its stderr if err is given;
+// returns the exit status of the last command
+static int capture(uint64_t argc, void** argv, String** out, String** err)
+{
+  int outFds[2], errFds[2] = {-1, -1};
+  if (pipe2(outFds, O_CLOEXEC) == -1 || (err && pipe2(errFds, O_CLOEXEC) == -1)) panic("capture(); pipe2() failed");
+  pid_t pids[argc];
+  pipeline(argc, argv, outFds[1], errFds[1], pids);
+  close(outFds[1]);
+  if (err) close(errFds[1]);
+
+  Capture c[2] = {{outFds[0]}, {errFds[0]}};
+  struct pollfd polls[2] = {{outFds[0], POLLIN, 0}, {errFds[0], POLLIN, 0}};
+  for (uint8_t remaining = err ? 2 : 1; remaining;)
   {
-    if (isChild)
-    {
-      close(pipefd[0]);
-      close(pipefd[1]);
-    }
-    pid_t w[2];
-    w[1] = 0;
-    for(uint8_t i = 0; i < 1 + isChild; i++)
+    if (poll(polls, 2, -1) == -1)
     {
-      int status;
-      w[i] = wait(&status);
-      if (w[i] == -1) continue;
-      if (WIFEXITED(status)) { if(WEXITSTATUS(status)) allSuccess = 0; }
+      if (errno == EINTR) continue;
+      panic("capture(); poll() failed");
     }
-    if ((w[0] == -1) || (w[1] == -1)) panic("fnPipe(); C wait() failed");
+    for (uint8_t i = 0; i < 2; i++)
+      if (polls[i].revents && !captureRead(&c[i]))
+      {
+	close(polls[i].fd);
+	polls[i].fd = -1; // poll ignores negative descriptors
+	remaining--;
+      }
   }
-  return allSuccess;
+
+  int status = 0;
+  for (uint64_t i = 0; i < argc; i++) status = waitStatus(pids[i]);
+  *out = captureString(&c[0]);
+  if (err) *err = captureString(&c[1]);
+  return status;
 }
 
-void* fnPipe(void* argList, void* env)
+void* fnCapture(uint64_t argc, void** argv)
 {
-  char* err =  "ERROR: pipe FAILED; MUST BE OF THE FORM (pipe arg-string-1 arg-string-2 ...)";
-  if (consCount(argList) < 2) return symbol(err);
-  void* l = evalList(argList, env);
-  for (void* ll = l; getObjTag(ll) != TAG_NIL; ll = cdr(ll))
-    if (getObjTag(car(ll)) != TAG_STR) return symbol(err);
-  char** execArgsOut = parseExecArgs(car(l));
-  const uint8_t allSuccess = pipeHelper(l, execArgsOut);
-  free(execArgsOut);
-  return allSuccess ? truth : nil;
+  char* err =  "ERROR: capture FAILED; MUST BE OF THE FORM (capture arg-string ...)";
+  if (argc < 1) return symbol(err);
+  for (uint64_t i = 0; i < argc; i++)
+    if (getObjTag(argv[i]) != TAG_STR) return symbol(err);
+  String* out;
+  capture(argc, argv, &out, NULL);
+  return out;
+}
+
+// (stdout-string exit-status stderr-string)
+void* fnCaptureAll(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: capture-all FAILED; MUST BE OF THE FORM (capture-all arg-string ...)";
+  if (argc < 1) return symbol(err);
+  for (uint64_t i = 0; i < argc; i++)
+    if (getObjTag(argv[i]) != TAG_STR) return symbol(err);
+  String* out, * errOut;
+  const int status = capture(argc, argv, &out, &errOut);
+  return cons(out, cons(number(status), cons(errOut, nil)));
 }
@@ -0,0 +1,101 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "turtle.h"
+
+// Stats
+// Each thread counts into its own context, so a counter update is a plain increment.
+// Reading sums the counters of every context and resetting clears them all, without
+// stopping other threads, so counts from threads busy at the time may be a little off.
+// Without TURTLE_STATS nothing is counted and (stats) returns ().
+#ifdef TURTLE_STATS
+static char* const counterNames[] =
+{
+#define STATS_NAME(field, name) name,
+  STATS_COUNTERS(STATS_NAME)
+#undef STATS_NAME
+};
+#define COUNTERS (sizeof(counterNames) / sizeof(counterNames[0]))
+
+static char* const tagNames[TAG_COUNT] =
+  {"symbol", "string", "number", "primitive", "closure", "macro", "nil", "cons", "table", "frame", "ref", "lambda", "vector", "f64-array", "future"};
+
+// Stats is all counters, the named ones first, so it can be summed word by word
+static Stats statsTotal()
+{
+  Stats total;
+  memset(&total, 0, sizeof(Stats));
+  for (Context* c = contextList(); c; c = c->next)
+    for (uint64_t i = 0; i < sizeof(Stats) / sizeof(uint64_t); i++)
+      ((uint64_t*)&total)[i] += ((const uint64_t*)&c->stats)[i];
+  return total;
+}
+
+static void statsDump()
+{
+  const Stats s = statsTotal();
+  fprintf(stderr, "turtle stats\n");
+  for (uint64_t i = 0; i < COUNTERS; i++) fprintf(stderr, "  %-20s %14lu\n", counterNames[i], ((const uint64_t*)&s)[i]);
+  fprintf(stderr, "  %-20s %14s %14s\n", "allocations", "count", "bytes");
+  for (uint8_t t = 0; t < TAG_COUNT; t++)
+    if (s.allocs[t]) fprintf(stderr, "    %-18s %14lu %14lu\n", tagNames[t], s.allocs[t], s.allocBytes[t]);
+}
+#endif
+
+// the collector's count, which every build keeps
+static void heapDump() { fprintf(stderr, "turtle heap\n  %-20s %14lu\n", "bytes-allocated", objBytesAllocated()); }
+
+// TURTLE_STATS set in the environment prints a summary to stderr at exit: the heap line
+// in every build, then the counters in builds with TURTLE_STATS
+void statsInit()
+{
+  if (!getenv("TURTLE_STATS")) return;
+#ifdef TURTLE_STATS
+  atexit(statsDump);
+#endif
+  atexit(heapDump);
+}
+
+// Primitives //////////////////////////////////////////////////////////////////////////////////////
+
+// association list of the counters, then (allocs (tag count bytes) ...) for obj() by tag
+void* fnStats(uint64_t argc, void** argv)
+{
+  if (argc) return symbol("ERROR: stats FAILED; MUST BE OF THE FORM (stats)");
+#ifdef TURTLE_STATS
+  const Stats s = statsTotal();
+  void* allocs = nil;
+  for (uint8_t t = TAG_COUNT; t--;)
+    if (s.allocs[t]) allocs = cons(cons(symbol(tagNames[t]), cons(number((double)s.allocs[t]), cons(number((double)s.allocBytes[t]), nil))), allocs);
+  void* x = cons(cons(symbol("allocs"), allocs), nil);
+  for (uint64_t i = COUNTERS; i--;) x = cons(cons(symbol(counterNames[i]), number((double)((const uint64_t*)&s)[i])), x);
+  return x;
+#else
+  return nil;
+#endif
+}
+
+void* fnStatsReset(uint64_t argc, void** argv)
+{
+  if (argc) return symbol("ERROR: stats-reset FAILED; MUST BE OF THE FORM (stats-reset)");
+  for (Context* c = contextList(); c; c = c->next) memset(&c->stats, 0, sizeof(Stats));
+  return nil;
+}
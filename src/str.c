@@ -0,0 +1,223 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#define _GNU_SOURCE // memmem
+#include "turtle.h"
+
+// String primitives
+// Results that are part of an argument (substring, split, trim) are slices and share its
+// characters; results that combine strings are built in a single allocation.
+
+// integral number in [0, max], or -1
+static int64_t stringIndex(const void* const i, const uint64_t max)
+{
+  if (getObjTag(i) != TAG_NUM) return -1;
+  const double n = numberValue(i);
+  return (n >= 0 && n <= (double)max && n == (double)(uint64_t)n) ? (int64_t)n : -1;
+}
+
+static uint8_t isSpace(const char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+void* fnStringLength(uint64_t argc, void** argv)
+{
+  if (argc != 1 || getObjTag(argv[0]) != TAG_STR)
+    return symbol("ERROR: string-length FAILED; MUST BE OF THE FORM (string-length string)");
+  return number((double)((String*)argv[0])->length);
+}
+
+void* fnSubstring(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: substring FAILED; MUST BE OF THE FORM (substring string start [end])";
+  if (argc < 2 || argc > 3 || getObjTag(argv[0]) != TAG_STR) return symbol(err);
+  const String* s = argv[0];
+  const int64_t start = stringIndex(argv[1], s->length);
+  const int64_t end = argc == 3 ? stringIndex(argv[2], s->length) : (int64_t)s->length;
+  if (start < 0 || end < start) return symbol("ERROR: substring FAILED; INDEX OUT OF RANGE");
+  return stringSlice(s, start, end);
+}
+
+void* fnStringAppend(uint64_t argc, void** argv)
+{
+  uint64_t length = 0;
+  for (uint64_t i = 0; i < argc; i++)
+  {
+    if (getObjTag(argv[i]) != TAG_STR) return symbol("ERROR: string-append FAILED; MUST BE OF THE FORM (string-append string ...)");
+    length += ((String*)argv[i])->length;
+  }
+  String* x = stringBuffer(length);
+  char* at = x->chars;
+  for (uint64_t i = 0; i < argc; i++)
+  {
+    memcpy(at, ((String*)argv[i])->chars, ((String*)argv[i])->length);
+    at += ((String*)argv[i])->length;
+  }
+  return x;
+}
+
+void* fnStringJoin(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: string-join FAILED; MUST BE OF THE FORM (string-join string-list [separator-string])";
+  if (argc < 1 || argc > 2 || (argc == 2 && getObjTag(argv[1]) != TAG_STR)) return symbol(err);
+  const String* sep = argc == 2 ? argv[1] : NULL;
+  uint64_t length = 0, count = 0;
+  void* l = argv[0];
+  for (; getObjTag(l) == TAG_CONS; l = ((Cons*)l)->cdr, count++)
+  {
+    if (getObjTag(((Cons*)l)->car) != TAG_STR) return symbol(err);
+    length += ((String*)((Cons*)l)->car)->length;
+  }
+  if (getObjTag(l) != TAG_NIL) return symbol(err); // not a proper list
+  if (sep && count) length += (count - 1) * sep->length;
+  String* x = stringBuffer(length);
+  char* at = x->chars;
+  uint64_t i = 0;
+  for (void* l = argv[0]; getObjTag(l) == TAG_CONS; l = ((Cons*)l)->cdr, i++)
+  {
+    const String* s = ((Cons*)l)->car;
+    if (sep && i) { memcpy(at, sep->chars, sep->length); at += sep->length; }
+    memcpy(at, s->chars, s->length);
+    at += s->length;
+  }
+  return x;
+}
+
+// Without a separator the string is split into its whitespace-separated fields;
+// with one, on each occurrence of it, keeping empty fields.
+void* fnStringSplit(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: string-split FAILED; MUST BE OF THE FORM (string-split string [separator-string])";
+  if (argc < 1 || argc > 2 || getObjTag(argv[0]) != TAG_STR) return symbol(err);
+  const String* s = argv[0];
+  void* head = nil;
+  Cons* tail = NULL;
+  #define FIELD(start, end)						\
+    do {								\
+      Cons* c = cons(stringSlice(s, (start), (end)), nil);		\
+      if (tail) tail->cdr = c; else head = c;				\
+      tail = c;								\
+    } while (0)
+  if (argc == 1)
+  {
+    uint64_t i = 0;
+    while (1)
+    {
+      while (i < s->length && isSpace(s->chars[i])) i++;
+      if (i == s->length) break;
+      const uint64_t start = i;
+      while (i < s->length && !isSpace(s->chars[i])) i++;
+      FIELD(start, i);
+    }
+    return head;
+  }
+  const String* sep = argv[1];
+  if (getObjTag(sep) != TAG_STR || !sep->length) return symbol(err);
+  uint64_t start = 0;
+  for (const char* at; (at = memmem(s->chars + start, s->length - start, sep->chars, sep->length));)
+  {
+    FIELD(start, at - s->chars);
+    start = at - s->chars + sep->length;
+  }
+  FIELD(start, s->length);
+  #undef FIELD
+  return head;
+}
+
+void* fnStringIndex(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: string-index FAILED; MUST BE OF THE FORM (string-index string substring [start])";
+  if (argc < 2 || argc > 3 || getObjTag(argv[0]) != TAG_STR || getObjTag(argv[1]) != TAG_STR) return symbol(err);
+  const String* s = argv[0], * needle = argv[1];
+  const int64_t start = argc == 3 ? stringIndex(argv[2], s->length) : 0;
+  if (start < 0) return symbol("ERROR: string-index FAILED; INDEX OUT OF RANGE");
+  const char* at = memmem(s->chars + start, s->length - start, needle->chars, needle->length);
+  return at ? number((double)(at - s->chars)) : nil;
+}
+
+void* fnStringTrim(uint64_t argc, void** argv)
+{
+  if (argc != 1 || getObjTag(argv[0]) != TAG_STR)
+    return symbol("ERROR: string-trim FAILED; MUST BE OF THE FORM (string-trim string)");
+  const String* s = argv[0];
+  uint64_t start = 0, end = s->length;
+  while (start < end && isSpace(s->chars[start])) start++;
+  while (end > start && isSpace(s->chars[end - 1])) end--;
+  return stringSlice(s, start, end);
+}
+
+// number read the way the reader reads it, or nil
+void* fnStringToNumber(uint64_t argc, void** argv)
+{
+  if (argc != 1 || getObjTag(argv[0]) != TAG_STR)
+    return symbol("ERROR: string->number FAILED; MUST BE OF THE FORM (string->number string)");
+  const String* s = argv[0];
+  double n;
+  return (s->length && scanNumber(stringCString(s), s->length, &n)) ? number(n) : nil;
+}
+
+// fewest significant digits that read back as n; integers, the common case, are written
+// directly. More digits never stop a number reading back, so the count is binary searched
+// between 1 and 17, which always suffices.
+uint64_t numberFormat(char* buf, const uint64_t size, const double n)
+{
+  if (fabs(n) <= FIXNUM_MAX && n == (int64_t)n && (n || !signbit(n)))
+  {
+    char digits[20];
+    uint64_t u = n < 0 ? (uint64_t)-(int64_t)n : (uint64_t)n, i = sizeof(digits), len = 0;
+    do digits[--i] = '0' + u % 10; while (u /= 10);
+    if (n < 0) buf[len++] = '-';
+    memcpy(buf + len, digits + i, sizeof(digits) - i);
+    len += sizeof(digits) - i;
+    buf[len] = '\0';
+    return len;
+  }
+  int lo = 1, hi = 17;
+  while (lo < hi)
+  {
+    const int precision = (lo + hi) / 2;
+    snprintf(buf, size, "%.*g", precision, n);
+    if (strtod(buf, NULL) == n) hi = precision; else lo = precision + 1;
+  }
+  return snprintf(buf, size, "%.*g", lo, n);
+}
+
+void* fnNumberToString(uint64_t argc, void** argv)
+{
+  if (argc != 1 || getObjTag(argv[0]) != TAG_NUM)
+    return symbol("ERROR: number->string FAILED; MUST BE OF THE FORM (number->string number)");
+  char buf[32];
+  const uint64_t len = numberFormat(buf, sizeof(buf), numberValue(argv[0]));
+  return stringOf(buf, len);
+}
+
+static int stringCompare(const String* x, const String* y)
+{
+  const int c = memcmp(x->chars, y->chars, x->length < y->length ? x->length : y->length);
+  return c ? c : (x->length > y->length) - (x->length < y->length);
+}
+
+static void* compare(char* err, const char op, uint64_t argc, void** argv)
+{
+  if (argc != 2 || getObjTag(argv[0]) != TAG_STR || getObjTag(argv[1]) != TAG_STR) return symbol(err);
+  const int c = stringCompare(argv[0], argv[1]);
+  return (op == '=' ? !c : op == '<' ? c < 0 : c > 0) ? truth : nil;
+}
+void* fnStringEq(uint64_t argc, void** argv) { return compare("ERROR: string=? FAILED; MUST BE OF THE FORM (string=? string-1 string-2)", '=', argc, argv); }
+void* fnStringLt(uint64_t argc, void** argv) { return compare("ERROR: string<? FAILED; MUST BE OF THE FORM (string<? string-1 string-2)", '<', argc, argv); }
+void* fnStringGt(uint64_t argc, void** argv) { return compare("ERROR: string>? FAILED; MUST BE OF THE FORM (string>? string-1 string-2)", '>', argc, argv); }
@@ -0,0 +1,263 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "turtle.h"
+
+// Open addressing hash table with linear probing.
+// Capacity is always a power of two and the table grows at 3/4 load, counting the
+// tombstones left by deletes. Interpreter tables are keyed by object identity; tables
+// made with hashTable() use the equality of eq? and hash to match it.
+//
+// Lookups may run alongside one writer, which is how threads read topLevel without a
+// lock. The capacity is kept in a header slot in front of the entries, so a single load of
+// the entries pointer gives a reader a consistent table, and a new key is stored after its
+// value. Resizing fills new storage before publishing it.
+#define TABLE_TOMBSTONE ((void*)6) // not a valid object, so never a key
+
+static uint64_t mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t hashPointer(const void* const key)
+{
+  objPin(key);
+  return mix((uint64_t)key >> 3);
+}
+
+// Structural hash agreeing with objEqual. Only a bounded prefix of a list or vector is
+// hashed so that hashing a long key stays cheap; equal objects share every prefix.
+#define HASH_ELEMENTS 16
+static uint64_t hashDouble(double n)
+{
+  if (n == 0) n = 0; // -0.0 is eq? to 0.0
+  uint64_t bits;
+  memcpy(&bits, &n, sizeof(bits));
+  return mix(bits);
+}
+
+static uint64_t hashObj(const void* x, const uint8_t depth)
+{
+  switch (getObjTag(x))
+  {
+    case TAG_NUM: return hashDouble(numberValue(x));
+    case TAG_STR:
+    {
+      uint64_t h = 14695981039346656037ULL; // FNV-1a
+      const String* s = x;
+      for (uint64_t i = 0; i < s->length; i++) h = (h ^ (uint8_t)s->chars[i]) * 1099511628211ULL;
+      return h;
+    }
+    case TAG_PRIM: return mix(*((uint8_t*)x) + 1);
+    case TAG_CLSR: return hashPointer(((Closure*)x)->lambda) ^ hashPointer(((Closure*)x)->env);
+    case TAG_MACRO: return hashObj(*((Cons**)x), depth);
+    case TAG_CONS: case TAG_VECTOR:
+    {
+      uint64_t h = getObjTag(x);
+      if (!depth) return h;
+      if (getObjTag(x) == TAG_VECTOR)
+      {
+	const Vector* v = x;
+	h = mix(h + v->count);
+	for (uint64_t i = 0; i < v->count && i < HASH_ELEMENTS; i++) h = mix(h ^ hashObj(v->items[i], depth - 1));
+	return h;
+      }
+      uint64_t i = 0;
+      for (; getObjTag(x) == TAG_CONS && i < HASH_ELEMENTS; x = ((Cons*)x)->cdr, i++)
+	h = mix(h ^ hashObj(((Cons*)x)->car, depth - 1));
+      return i < HASH_ELEMENTS ? mix(h ^ hashObj(x, depth - 1)) : h;
+    }
+    case TAG_F64:
+    {
+      const F64Array* a = x;
+      uint64_t h = mix(TAG_F64 + a->count);
+      for (uint64_t i = 0; i < a->count && i < HASH_ELEMENTS; i++) h = mix(h ^ hashDouble(a->data[i]));
+      return h;
+    }
+    default: return hashPointer(x); // symbols are interned; everything else is eq? only to itself
+  }
+}
+
+static uint64_t tableHash(const Table* const t, const void* const key) { return t->equal ? hashObj(key, 4) : hashPointer(key); }
+
+static TableEntry* tableEntries(const uint64_t capacity)
+{
+  TableEntry* entries = objAllocValues((capacity + 1) * sizeof(TableEntry));
+  memset(entries, 0, (capacity + 1) * sizeof(TableEntry));
+  entries[0].key = (void*)((capacity << 1) | IMM_FIXNUM);
+  return entries + 1;
+}
+
+static uint64_t entriesCapacity(const TableEntry* const entries) { return (uint64_t)entries[-1].key >> 1; }
+
+static Table* tableNew(uint64_t capacity, const uint8_t equal)
+{
+  uint64_t c = 8;
+  while (c < capacity) c *= 2;
+  Table* x = (Table*)obj(TAG_TABLE, sizeof(Table));
+  x->count = 0;
+  x->used = 0;
+  x->capacity = c;
+  x->equal = equal;
+  x->entries = tableEntries(c);
+  return x;
+}
+
+Table* table(uint64_t capacity) { return tableNew(capacity, 0); }
+Table* hashTable(uint64_t capacity) { return tableNew(capacity, 1); }
+
+// the entry holding key, or NULL; safe alongside a writer
+static TableEntry* tableLookup(const Table* const t, const void* const key)
+{
+  TableEntry* entries = __atomic_load_n(&t->entries, __ATOMIC_ACQUIRE);
+  const uint64_t mask = entriesCapacity(entries) - 1;
+  for (uint64_t i = tableHash(t, key) & mask;; i = (i + 1) & mask)
+  {
+    const void* k = __atomic_load_n(&entries[i].key, __ATOMIC_ACQUIRE);
+    if (!k) return NULL;
+    if (k != TABLE_TOMBSTONE && (k == key || (t->equal && objEqual(k, key)))) return &entries[i];
+  }
+}
+
+// for the writer: the entry of entries holding key, or else the free entry where it would go
+static TableEntry* tableFind(const Table* const t, TableEntry* const entries, const void* const key)
+{
+  const uint64_t mask = entriesCapacity(entries) - 1;
+  TableEntry* tomb = NULL;
+  for (uint64_t i = tableHash(t, key) & mask;; i = (i + 1) & mask)
+  {
+    TableEntry* e = &entries[i];
+    if (!e->key) return tomb ? tomb : e;
+    if (e->key == TABLE_TOMBSTONE) { if (!tomb) tomb = e; }
+    else if (e->key == key || (t->equal && objEqual(e->key, key))) return e;
+  }
+}
+
+// reinsert the live entries into fresh storage of the given capacity, dropping tombstones
+static void tableResize(Table* const t, const uint64_t capacity)
+{
+  TableEntry* old = t->entries, * entries = tableEntries(capacity);
+  for (uint64_t i = 0; i < t->capacity; i++)
+    if (old[i].key && old[i].key != TABLE_TOMBSTONE) *tableFind(t, entries, old[i].key) = old[i];
+  __atomic_store_n(&t->entries, entries, __ATOMIC_RELEASE);
+  t->capacity = capacity;
+  t->used = t->count;
+}
+
+void tableRehash(Table* const t) { tableResize(t, t->capacity); }
+
+void* tableRef(const Table* const t, const void* const key)
+{
+  const TableEntry* e = tableLookup(t, key);
+  return e ? __atomic_load_n(&e->v, __ATOMIC_RELAXED) : NULL;
+}
+
+void tableSet(Table* const t, void* const key, void* const v)
+{
+  if (4 * (t->used + 1) > 3 * t->capacity)
+    tableResize(t, 2 * t->count + 2 > t->capacity / 2 ? 2 * t->capacity : t->capacity);
+  TableEntry* e = tableFind(t, t->entries, key);
+  if (!e->key || e->key == TABLE_TOMBSTONE)
+  {
+    if (!e->key) t->used++;
+    t->count++;
+    e->v = v;
+    __atomic_store_n(&e->key, key, __ATOMIC_RELEASE);
+  }
+  else __atomic_store_n(&e->v, v, __ATOMIC_RELAXED);
+}
+
+uint8_t tableDelete(Table* const t, const void* const key)
+{
+  TableEntry* e = tableLookup(t, key);
+  if (!e) return 0;
+  __atomic_store_n(&e->key, TABLE_TOMBSTONE, __ATOMIC_RELEASE);
+  e->v = NULL;
+  t->count--;
+  return 1;
+}
+
+// Primitives //////////////////////////////////////////////////////////////////////////////////////
+
+void* fnHashTable(uint64_t argc, void** argv)
+{
+  if (argc % 2) return symbol("ERROR: hash-table FAILED; MUST BE OF THE FORM (hash-table [key value] ...)");
+  Table* t = hashTable(argc);
+  for (uint64_t i = 0; i < argc; i += 2) tableSet(t, argv[i], argv[i + 1]);
+  return t;
+}
+
+static uint8_t isHashTable(const void* const x) { return getObjTag(x) == TAG_TABLE && ((Table*)x)->equal; }
+
+void* fnHashTableRef(uint64_t argc, void** argv)
+{
+  if (argc < 2 || argc > 3 || !isHashTable(argv[0]))
+    return symbol("ERROR: hash-table-ref FAILED; MUST BE OF THE FORM (hash-table-ref table key [default])");
+  void* v = tableRef(argv[0], argv[1]);
+  return v ? v : argc == 3 ? argv[2] : nil;
+}
+
+void* fnHashTableSet(uint64_t argc, void** argv)
+{
+  if (argc != 3 || !isHashTable(argv[0]))
+    return symbol("ERROR: hash-table-set FAILED; MUST BE OF THE FORM (hash-table-set table key value)");
+  tableSet(argv[0], argv[1], argv[2]);
+  return argv[2];
+}
+
+void* fnHashTableDelete(uint64_t argc, void** argv)
+{
+  if (argc != 2 || !isHashTable(argv[0]))
+    return symbol("ERROR: hash-table-delete FAILED; MUST BE OF THE FORM (hash-table-delete table key)");
+  return tableDelete(argv[0], argv[1]) ? truth : nil;
+}
+
+void* fnHashTableCount(uint64_t argc, void** argv)
+{
+  if (argc != 1 || !isHashTable(argv[0]))
+    return symbol("ERROR: hash-table-count FAILED; MUST BE OF THE FORM (hash-table-count table)");
+  return number((double)((Table*)argv[0])->count);
+}
+
+// association list of the entries, in no particular order
+void* fnHashTableToList(uint64_t argc, void** argv)
+{
+  if (argc != 1 || !isHashTable(argv[0]))
+    return symbol("ERROR: hash-table->list FAILED; MUST BE OF THE FORM (hash-table->list table)");
+  const Table* t = argv[0];
+  void* x = nil;
+  for (uint64_t i = 0; i < t->capacity; i++)
+    if (t->entries[i].key && t->entries[i].key != TABLE_TOMBSTONE) x = cons(cons(t->entries[i].key, t->entries[i].v), x);
+  return x;
+}
+
+void* fnHashTableKeys(uint64_t argc, void** argv)
+{
+  if (argc != 1 || !isHashTable(argv[0]))
+    return symbol("ERROR: hash-table-keys FAILED; MUST BE OF THE FORM (hash-table-keys table)");
+  const Table* t = argv[0];
+  void* x = nil;
+  for (uint64_t i = 0; i < t->capacity; i++)
+    if (t->entries[i].key && t->entries[i].key != TABLE_TOMBSTONE) x = cons(t->entries[i].key, x);
+  return x;
+}
@@ -28,193 +28,486 @@ void panic(char* str)
 
 void* nil;
 char* truth, * falsity;
-void* topLevel;
+Table* topLevel;
+uint8_t engineVM = 0;
 
-void* eval(void* x, void* env)
+static pthread_mutex_t globalLock = PTHREAD_MUTEX_INITIALIZER;
+void globalSet(void* const sym, void* const v)
 {
-  switch (getObjTag(x))
+  pthread_mutex_lock(&globalLock);
+  if (getObjTag(v) == TAG_CLSR) lambdaName(((Closure*)v)->lambda, sym);
+  tableSet(topLevel, sym, v);
+  pthread_mutex_unlock(&globalLock);
+}
+
+// Contexts
+// Each thread that evaluates gets a context; the list of them keeps their collected
+// state reachable, since the collector does not scan thread-local storage.
+_Thread_local Context* context = NULL;
+static Context* contexts = NULL;
+static pthread_mutex_t contextLock = PTHREAD_MUTEX_INITIALIZER;
+
+// C stack guard; non-tail recursion in eval fails with an error instead of crashing.
+// The overflow is sticky until the next top-level form so a test that sees the error
+// symbol cannot treat it as true and carry on.
+Context* contextInit(void* stackBase, uint64_t stackSize)
+{
+  Context* c = objAlloc(sizeof(Context));
+  memset(c, 0, sizeof(Context));
+  c->stackBase = (uintptr_t)stackBase;
+  c->stackLimit = stackSize - stackSize / 4; // leave headroom for primitives and libc
+  pthread_mutex_lock(&contextLock);
+  c->next = contexts;
+  __atomic_store_n(&contexts, c, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&contextLock);
+  context = c;
+  return c;
+}
+
+// contexts are only ever added at the head, so the list can be walked without the lock
+Context* contextList() { return __atomic_load_n(&contexts, __ATOMIC_ACQUIRE); }
+
+// Macro expansion cache
+// Expansions are memoised per call site, keyed by the identity of the call's argument
+// list, and stored analysed against the scope they were expanded in. An entry is reused
+// only for the same macro object in the same scope, so expanders are assumed to depend on
+// their arguments alone. Redefining a macro through global clears the cache; each thread
+// keeps its own cache and drops it when it sees the generation has moved on.
+#define MACRO_CACHE_MAX 4096
+typedef struct Expansion { void* macro, * scope, * forms; } Expansion;
+static uint64_t macroGeneration = 0;
+
+void macroCacheClear() { __atomic_add_fetch(&macroGeneration, 1, __ATOMIC_RELEASE); }
+
+static void* expand(void* fn, void* argList, void* env)
+{
+  Context* cx = context;
+  const uint64_t generation = __atomic_load_n(&macroGeneration, __ATOMIC_ACQUIRE);
+  if (cx->macroGeneration != generation)
   {
-    case TAG_SYM: return assocRef(x, env);
-    case TAG_CONS: return apply(eval(car(x), env), cdr(x), env);
-    default: return x;
+    cx->macroCache = NULL;
+    cx->macroGeneration = generation;
   }
+  Table* macroCache = cx->macroCache;
+  Expansion* x = (getObjTag(argList) == TAG_CONS && macroCache) ? tableRef(macroCache, argList) : NULL;
+  if (x && x->macro == fn && envScopeMatches(x->scope, env))
+  {
+    STAT(macroCacheHits, 1);
+    return x->forms;
+  }
+  STAT(macroExpansions, 1);
+
+  Cons* c = *((Cons**)fn);
+  void* macroArgList = car(c), * macroBody = cdr(c), * e = frame(macroArgList, unresolve(argList), env);
+  void* scope = envScope(env);
+  void* forms = analyseSeq(evalList(macroBody, e), scope);
+  if (getObjTag(argList) != TAG_CONS) return forms; // nothing identifies the call site
+
+  if (!macroCache || macroCache->count >= MACRO_CACHE_MAX) macroCache = cx->macroCache = table(64);
+  x = objAlloc(sizeof(Expansion));
+  x->macro = fn;
+  x->scope = scope;
+  x->forms = forms;
+  tableSet(macroCache, argList, x);
+  return forms;
 }
 
-void* evalList(void* x, void* env)
+// Arguments are evaluated into argv, which the caller provides with room for ARGV_INLINE
+// values on its stack; longer argument lists move to a collected vector. A dotted tail
+// is evaluated and its elements spread into the arguments.
+static void** argvPush(void** argv, uint64_t* argc, uint64_t* capacity, void* const x)
 {
-  switch (getObjTag(x))
+  if (*argc == *capacity)
   {
-    case TAG_SYM: return assocRef(x, env);
-    case TAG_CONS: return cons(eval(car(x), env), evalList(cdr(x), env));
-    default: return nil;
+    void** grown = objAllocValues(2 * *capacity * sizeof(void*));
+    memcpy(grown, argv, *argc * sizeof(void*));
+    argv = grown;
+    *capacity *= 2;
   }
+  argv[(*argc)++] = x;
+  return argv;
 }
 
-void* apply(void* fn, void* argList, void* env)
+static void** evalArgs(void* argList, void* env, void** argv, uint64_t* argc)
 {
+  uint64_t capacity = ARGV_INLINE;
+  *argc = 0;
+  for (; getObjTag(argList) == TAG_CONS; argList = ((Cons*)argList)->cdr)
+    argv = argvPush(argv, argc, &capacity, eval(((Cons*)argList)->car, env));
+  const uint8_t tag = getObjTag(argList);
+  if (tag == TAG_SYM || tag == TAG_REF)
+    for (void* l = eval(argList, env); getObjTag(l) == TAG_CONS; l = ((Cons*)l)->cdr)
+      argv = argvPush(argv, argc, &capacity, ((Cons*)l)->car);
+  return argv;
+}
+
+// Apply fn, leaving either the result in *x (returns 0) or an expression in tail position
+// to be evaluated in *env (returns 1). eval loops on the latter so tail calls run in
+// constant space. A closure takes the caller's slot at depth on the shadow call stack,
+// so a tail call replaces its caller there too.
+static uint8_t applyStep(void* fn, void* argList, void** x, void** env, const uint64_t depth)
+{
+  STAT(calls, 1);
   switch (getObjTag(fn))
   {
-    case TAG_PRIM: return getPrimitiveFn(*((uint8_t*)fn))(argList, env);
+    case TAG_PRIM:
+    {
+      const Primitive* p = getPrimitive(*((uint8_t*)fn));
+      if (p->form)
+      {
+	*x = p->form(argList, *env);
+	return p->tail;
+      }
+      void* inlineArgv[ARGV_INLINE];
+      uint64_t argc;
+      void** argv = evalArgs(argList, *env, inlineArgv, &argc);
+      *x = p->fn(argc, argv);
+      return 0;
+    }
     case TAG_CLSR:
     {
-      Cons* c = *((Cons**)fn);
-      void* cc = car(c), * clsrArgList = car(cc), * clsrBody = cdr(cc), * e = (getObjTag(cdr(c)) == TAG_NIL) ? env : nil;
-      e = assocList(clsrArgList, evalList(argList, env), e);
-      void* x = nil;
-      for (void* l = evalList(clsrBody, e); getObjTag(l) != TAG_NIL; l = cdr(l)) x = car(l);
-      return x;
+      Closure* c = (Closure*)fn;
+      void* inlineArgv[ARGV_INLINE];
+      uint64_t argc;
+      void** argv = evalArgs(argList, *env, inlineArgv, &argc);
+      *env = frameArgs(c->lambda->params, argc, argv, c->env);
+      callsSet(context, depth, c->lambda);
+      void* l = c->lambda->body;
+      if (getObjTag(l) != TAG_CONS) { *x = nil; return 0; }
+      for (; getObjTag(cdr(l)) == TAG_CONS; l = cdr(l)) eval(car(l), *env);
+      *x = car(l);
+      return 1;
     }
     case TAG_MACRO:
     {
-      Cons* c = *((Cons**)fn);
-      void* macroArgList = car(c), * macroBody = cdr(c), * e = assocList(macroArgList, argList, env);
-      void* x = nil;
-      for (void* l = evalList(evalList(macroBody, e), env); getObjTag(l) != TAG_NIL; l = cdr(l)) x = car(l);
-      return x;
+      void* l = expand(fn, argList, *env);
+      if (getObjTag(l) != TAG_CONS) { *x = nil; return 0; }
+      for (; getObjTag(cdr(l)) == TAG_CONS; l = cdr(l)) eval(car(l), *env);
+      *x = car(l);
+      return 1;
     }
-    default: return symbol("ERROR: APPLY FAILED; APPLY ONLY ACCEPTS OBJECTS WITH TAG_PRIM, TAG_CLSR, or TAG_MACRO"); 
+    default:
+      *x = symbol("ERROR: APPLY FAILED; APPLY ONLY ACCEPTS OBJECTS WITH TAG_PRIM, TAG_CLSR, or TAG_MACRO");
+      return 0;
   }
 }
 
-// Print
-void printList(const Cons* x);
-void printObj(const void* x)
+void* eval(void* x, void* env)
 {
-  switch(getObjTag(x))
+  char probe;
+  Context* cx = context;
+  if (cx->stackOverflow || cx->stackBase - (uintptr_t)&probe > cx->stackLimit)
   {
-    case TAG_SYM: printf("%s", (char*)x); return;
-    case TAG_NUM: printf("%lf", *((double*)x)); return;
-    case TAG_STR: printf("\"%s\"", (char*)x); return;
-    case TAG_NIL: printf("()"); return; 
-    case TAG_CONS: printList(x); return;
-    case TAG_PRIM: printf("<primitive>%u", *((uint8_t*)x)); return;
-    case TAG_CLSR: printf("<closure>%p", *((Cons**)x)); return;
-    case TAG_MACRO: printf("<macro>%p", *((Cons**)x)); return; 
-    default: printf("Object has invalid type"); return;
+    cx->stackOverflow = 1;
+    return symbol("ERROR: eval FAILED; STACK OVERFLOW");
   }
-}
-void printList(const Cons* x)
-{
-  printf("(");
+  STAT(evals, 1);
+  const uint64_t depth = cx->callDepth;
   while (1)
   {
-    printObj(x->car);
-    x = x->cdr;
-    const uint8_t tag = getObjTag(x); 
-    if (tag == TAG_NIL) break;
-    if (tag != TAG_CONS)
+    switch (getObjTag(x))
     {
-      printf(" . ");
-      printObj(x);
-      break;
+      case TAG_SYM: x = envRef(x, env); break;
+      case TAG_REF: x = refValue(x, env); break;
+      case TAG_LAMBDA: x = closure(x, env); break;
+      case TAG_CONS:
+	if (applyStep(eval(car(x), env), cdr(x), &x, &env, depth)) continue;
+	break;
     }
-    printf(" ");
+    cx->callDepth = depth;
+    return x;
   }
-  printf(")");
 }
 
-// Read
-#define BUFFER_SIZE 64
-char buffer[BUFFER_SIZE];
-int lookAt = ' ';
-void peek()
-{
-  lookAt = getchar();
-  if (lookAt == ';')
-    while (lookAt != '\n' && lookAt != EOF) lookAt = getchar();
-  if (lookAt == EOF) exit(EXIT_SUCCESS);
-}
-uint8_t lookingAtBracket() { return (lookAt == '(') || (lookAt == ')') || (lookAt == '[') || (lookAt == ']'); }
-void nextToken()
+void* evalList(void* x, void* env)
 {
-  uint8_t i = 0;
-  while (lookAt <= ' ') peek();
-  if ((lookAt == '\'') || lookingAtBracket())
-    { buffer[i++] = lookAt; peek(); }
-  else if (lookAt == '"') // copy [" t o k e n \0] to buffer; lead with " for parsing
+  void* head = nil;
+  Cons* tail = NULL;
+  for (; getObjTag(x) == TAG_CONS; x = cdr(x))
   {
-    do { buffer[i++] = lookAt; peek(); } while (i < BUFFER_SIZE - 1 && (lookAt != '"') && (lookAt != '\n'));
-    if (lookAt != '"') fprintf(stderr, "nextToken: missing closing double quote\n");
-    peek();
+    Cons* c = cons(eval(car(x), env), nil);
+    if (tail) tail->cdr = c; else head = c;
+    tail = c;
   }
-  else
-    do { buffer[i++] = lookAt; peek(); } while (i < BUFFER_SIZE - 1 && (lookAt > ' ') && !lookingAtBracket());
-  buffer[i] = '\0';
+  switch (getObjTag(x))
+  {
+    case TAG_SYM: case TAG_REF: // dotted argument list
+    {
+      void* v = eval(x, env);
+      if (tail) tail->cdr = v; else head = v;
+      return head;
+    }
+    default: return head;
+  }
+}
+
+void* apply(void* fn, void* argList, void* env)
+{
+  void* x;
+  const uint64_t depth = context->callDepth;
+  if (applyStep(fn, argList, &x, &env, depth)) x = eval(x, env);
+  context->callDepth = depth;
+  return x;
 }
-void* parse();
-void* readInput() { nextToken(); return parse(); }
-void* parseList()
+
+// call a function primitive or closure on arguments that are already evaluated
+void* applyArgv(void* fn, uint64_t argc, void** argv)
 {
-  nextToken();
-  if (buffer[0] == ')') return nil;
-  if(!strcmp(buffer, "."))
+  STAT(calls, 1);
+  switch (getObjTag(fn))
   {
-    void* x = readInput();
-    nextToken();
-    return x;
+    case TAG_PRIM:
+    {
+      const Primitive* p = getPrimitive(*((uint8_t*)fn));
+      if (p->fn) return p->fn(argc, argv);
+      break;
+    }
+    case TAG_CLSR:
+    {
+      Closure* c = (Closure*)fn;
+      if (engineVM) return vmApply(c, argc, argv);
+      void* env = frameArgs(c->lambda->params, argc, argv, c->env);
+      void* l = c->lambda->body;
+      if (getObjTag(l) != TAG_CONS) return nil;
+      const uint64_t depth = context->callDepth;
+      callsSet(context, depth, c->lambda);
+      for (; getObjTag(cdr(l)) == TAG_CONS; l = cdr(l)) eval(car(l), env);
+      void* x = eval(car(l), env);
+      context->callDepth = depth;
+      return x;
+    }
   }
-  
-  void* x = parse();
-  return cons(x, parseList());
+  return symbol("ERROR: APPLY FAILED; ONLY FUNCTION PRIMITIVES AND CLOSURES CAN BE CALLED WITH EVALUATED ARGUMENTS");
 }
-void* parseListSquare()
+
+// Print
+// Objects are written to the output buffer, between outBegin and outEnd. Lists and vectors
+// are printed with an explicit stack of the ones still open, so neither depth nor length
+// is limited by the C stack.
+typedef struct PrintFrame { const void* rest; uint64_t i; } PrintFrame; // a list's tail, or a vector and its next index
+
+// anything but a non-empty list or vector
+static void printAtom(const void* x)
 {
-  nextToken();
-  if (buffer[0] == ']') return nil;
-  if(!strcmp(buffer, "."))
+  switch(getObjTag(x))
   {
-    void* x = readInput();
-    nextToken();
-    return x;
+    case TAG_SYM: outString(x); return;
+    case TAG_NUM: outNumber(numberValue(x)); return;
+    case TAG_STR: outChar('"'); outWrite(((String*)x)->chars, ((String*)x)->length); outChar('"'); return;
+    case TAG_NIL: outString("()"); return;
+    case TAG_PRIM: outString("<primitive>"); outNumber(*((uint8_t*)x)); return;
+    case TAG_CLSR:
+    {
+      const char* name = lambdaNameOf(((Closure*)x)->lambda);
+      outString("<closure");
+      if (name) { outChar(' '); outString(name); }
+      outChar('>');
+      outPointer(x);
+      return;
+    }
+    case TAG_MACRO: outString("<macro>"); outPointer(*((Cons**)x)); return;
+    case TAG_TABLE: outString("<table>"); outPointer(x); return;
+    case TAG_FRAME: outString("<frame>"); outPointer(x); return;
+    case TAG_REF: outString(((Ref*)x)->sym); return;
+    case TAG_LAMBDA: outString("<lambda>"); outPointer(x); return;
+    case TAG_FUTURE: outString("<future>"); outPointer(x); return;
+    case TAG_VECTOR: outString("#()"); return;
+    case TAG_F64:
+    {
+      const F64Array* a = x;
+      outString("#f64(");
+      for (uint64_t i = 0; i < a->count; i++)
+      {
+	if (i) outChar(' ');
+	outNumber(a->data[i]);
+      }
+      outChar(')');
+      return;
+    }
+    default: outString("Object has invalid type"); return;
   }
-  
-  void* x = parse();
-  return cons(x, parseListSquare());
 }
-void* parse()
+
+void printObj(const void* x)
 {
-  switch (buffer[0])
+  PrintFrame inlineStack[64], * stack = inlineStack;
+  uint64_t depth = 0, capacity = sizeof(inlineStack) / sizeof(inlineStack[0]);
+  while (1)
   {
-    case '\'': return cons(symbol("quote"), cons(readInput(), nil));
-    case '"': return string(buffer + 1);
-    case '(': return parseList();
-    case '[': return parseListSquare();
-    default:
+    // open lists and vectors down to the first atom
+    for (uint8_t tag; (tag = getObjTag(x)) == TAG_CONS || (tag == TAG_VECTOR && ((Vector*)x)->count);)
     {
-      double n;
-      int i;
-      if (sscanf(buffer, "%lf%n", &n, &i) > 0 && buffer[i] == '\0')
-	return number(n);
+      if (depth == capacity)
+      {
+	PrintFrame* grown = malloc(2 * capacity * sizeof(PrintFrame));
+	if (!grown) panic("printObj(): malloc failed");
+	memcpy(grown, stack, capacity * sizeof(PrintFrame));
+	if (stack != inlineStack) free(stack);
+	stack = grown;
+	capacity *= 2;
+      }
+      if (tag == TAG_CONS)
+      {
+	outChar('(');
+	stack[depth++] = (PrintFrame){((Cons*)x)->cdr, 0};
+	x = ((Cons*)x)->car;
+      }
       else
-	return symbol(buffer);
+      {
+	outString("#(");
+	stack[depth++] = (PrintFrame){x, 1};
+	x = ((Vector*)x)->items[0];
+      }
     }
+    printAtom(x);
+
+    // close what is finished and move on to the next element
+    while (1)
+    {
+      if (!depth)
+      {
+	if (stack != inlineStack) free(stack);
+	return;
+      }
+      PrintFrame* f = &stack[depth - 1];
+      if (f->i) // a vector
+      {
+	const Vector* v = f->rest;
+	if (f->i < v->count) { outChar(' '); x = v->items[f->i++]; break; }
+      }
+      else if (getObjTag(f->rest) == TAG_CONS)
+      {
+	outChar(' ');
+	x = ((Cons*)f->rest)->car;
+	f->rest = ((Cons*)f->rest)->cdr;
+	break;
+      }
+      else if (getObjTag(f->rest) != TAG_NIL)
+      {
+	outString(" . ");
+	x = f->rest;
+	f->rest = nil;
+	break;
+      }
+      outChar(')');
+      depth--;
+    }
+  }
+}
+
+// a byte count with an optional k, m or g suffix; 0 if malformed
+static uint64_t parseSize(const char* s)
+{
+  char* end;
+  const uint64_t n = strtoull(s, &end, 10);
+  switch (*end)
+  {
+    case '\0': return n;
+    case 'k': case 'K': return end[1] ? 0 : n << 10;
+    case 'm': case 'M': return end[1] ? 0 : n << 20;
+    case 'g': case 'G': return end[1] ? 0 : n << 30;
+    default: return 0;
   }
-} 
+}
+
+// Once the C stack overflows every eval fails, and the error may reach a primitive as an
+// operand and come back as that primitive's type error, so the sticky flag decides.
+static void* topLevelEval(void* x)
+{
+  context->stackOverflow = 0;
+  x = engineVM ? vmEval(x) : eval(x, nil);
+  return context->stackOverflow ? symbol("ERROR: eval FAILED; STACK OVERFLOW") : x;
+}
 
-int main()
+int main(int argc, char** argv)
 {
-  objInit();
+  char* script = NULL, * image = NULL;
+  GcOptions gc = {0};
+  uint8_t usage = 0;
+  for (int i = 1; i < argc && !usage; i++)
+  {
+    const uint8_t more = i + 1 < argc;
+    if (!strcmp(argv[i], "--vm")) engineVM = 1;
+    else if (!strcmp(argv[i], "--tree")) engineVM = 0;
+    else if (!strcmp(argv[i], "--image") && more) image = argv[++i];
+    else if (!strcmp(argv[i], "--gc-incremental")) gc.incremental = 1;
+    else if (!strcmp(argv[i], "--gc-markers") && more) usage = !(gc.markers = parseSize(argv[++i]));
+    else if (!strcmp(argv[i], "--gc-heap") && more) usage = !(gc.heap = parseSize(argv[++i]));
+    else if (!strcmp(argv[i], "--gc-max-heap") && more) usage = !(gc.maxHeap = parseSize(argv[++i]));
+    else if (!strcmp(argv[i], "--gc-divisor") && more) usage = !(gc.divisor = parseSize(argv[++i]));
+    else if (!strcmp(argv[i], "--gc-pause") && more) usage = !(gc.pauseTarget = parseSize(argv[++i]));
+    else if (!strcmp(argv[i], "--gc-nursery") && more) usage = !(gc.nursery = parseSize(argv[++i]));
+    else if (argv[i][0] != '-' && !script) script = argv[i];
+    else usage = 1;
+  }
+  if (usage)
+  {
+    fprintf(stderr, "usage: %s [--vm | --tree] [--image file] [--gc-incremental] [--gc-markers n] [--gc-heap size]\n"
+	    "       [--gc-max-heap size] [--gc-divisor n] [--gc-pause ms] [--gc-nursery size] [script]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  jobsInit(); // before the collector or the pool start threads
+  objInit(&gc);
+  atexit(outFlush);
+  struct rlimit rl;
+  uint64_t stackSize = 8 << 20;
+  if (!getrlimit(RLIMIT_STACK, &rl) && rl.rlim_cur != RLIM_INFINITY) stackSize = rl.rlim_cur;
+  contextInit(&argc, stackSize);
+  statsInit();
 
-  nil = obj(TAG_NIL, 0);
+  nil = IMM_NIL;
   truth = symbol("#t");
   falsity = symbol("#f");
+  envInit();
   
   // initial top-level environment
-  topLevel = nil;
-  topLevel = assocCons(truth, truth, topLevel);
-  topLevel = assocCons(falsity, nil, topLevel);
-  topLevel = setPrimitives(topLevel);
-  /*
-  printf("Top-Level Environment:\n");
-  printObj(topLevel);
-  printf("\n");
-  */
+  topLevel = table(64);
+  globalSet(truth, truth);
+  globalSet(falsity, nil);
+  setPrimitives(topLevel);
+  if (image && !imageLoad(image))
+  {
+    fprintf(stderr, "%s: cannot load image %s\n", argv[0], image);
+    return EXIT_FAILURE;
+  }
   
+  // top-level forms run with an empty local environment
+  if (script)
+  {
+    Reader* r = readerOpen(script);
+    if (!r)
+    {
+      fprintf(stderr, "%s: cannot open %s: %s\n", argv[0], script, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    for (void* x; (x = readForm(r));)
+    {
+      x = topLevelEval(x); // a script prints no results, so only an overflow is reported
+      if (context->stackOverflow)
+      {
+	outFlush();
+	fprintf(stderr, "%s\n", (char*)x);
+      }
+    }
+    readerClose(r);
+    return EXIT_SUCCESS;
+  }
+
   // REPL
+  Reader* r = readerStdin();
   while(1)
   {
-    printf(">");
-    printObj(eval(readInput(), topLevel));
-    printf("\n");
+    outBegin();
+    outChar('>');
+    outEnd();
+    outFlush();
+    void* x = readForm(r);
+    if (!x) return EXIT_SUCCESS;
+    x = topLevelEval(x);
+    outBegin();
+    printObj(x);
+    outChar('\n');
+    outEnd();
   }
 }
@@ -3,43 +3,147 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <math.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <errno.h>
+#include <pthread.h>
 
 // turtle.c ////////////////////////////////////////////////////////////////////////////////////////
 void panic(char* str);
 
-enum { TAG_SYM, TAG_STR, TAG_NUM, TAG_PRIM, TAG_CLSR, TAG_MACRO, TAG_NIL, TAG_CONS};
+enum { TAG_SYM, TAG_STR, TAG_NUM, TAG_PRIM, TAG_CLSR, TAG_MACRO, TAG_NIL, TAG_CONS, TAG_TABLE, TAG_FRAME, TAG_REF, TAG_LAMBDA, TAG_VECTOR, TAG_F64, TAG_FUTURE, TAG_COUNT};
 typedef struct Cons { void* car, * cdr; } Cons;
-typedef void* (*PrimitiveFn)(void*, void*);
-typedef struct Primitive { char* name; PrimitiveFn fn; } Primitive;
+// A primitive is either a function, which receives its evaluated arguments as a vector,
+// or a special form, which receives its argument list unevaluated along with the
+// environment. A tail form returns the expression to evaluate next in that environment.
+typedef void* (*PrimitiveFn)(uint64_t argc, void** argv);
+typedef void* (*FormFn)(void* argList, void* env);
+typedef struct Primitive { char* name; PrimitiveFn fn; FormFn form; uint8_t tail; } Primitive;
+typedef struct TableEntry { void* key, * v; } TableEntry;
+typedef struct Table { uint64_t count, used, capacity; TableEntry* entries; uint8_t equal; } Table; // used counts tombstones too
+typedef struct Frame { struct Frame* parent; void* names; uint64_t count; void* slots[]; } Frame;
+#define REF_GLOBAL UINT32_MAX
+typedef struct Ref { void* sym; uint32_t depth, slot; } Ref;
+typedef struct Lambda { void* params, * body, * code; char* name; } Lambda; // body is analysed; code is compiled lazily by the VM
+typedef struct Closure { Lambda* lambda; void* env; } Closure;
+typedef struct Vector { uint64_t count, capacity; void** items; } Vector;
+typedef struct String { uint64_t length; char* chars; } String; // chars are NUL-terminated unless the string is a slice
+typedef struct F64Array { uint64_t count; double* data; } F64Array;
 
 extern void* nil;
 extern char* truth;
 extern char* falsity;
-extern void* topLevel;
+extern Table* topLevel; // global environment; local environments are chains of frames
+extern uint8_t engineVM; // closures called from C run on the VM
 
+// Interpreter counters, kept per thread and summed by stats.c. They are only updated in
+// builds with TURTLE_STATS; elsewhere STAT compiles to nothing.
+#define STATS_COUNTERS(X) \
+  X(evals, "evals") X(calls, "calls") X(vmInstructions, "vm-instructions") \
+  X(lookups, "lookups") X(lookupDepth, "lookup-depth") X(nameLookups, "name-lookups") X(globalLookups, "global-lookups") \
+  X(macroExpansions, "macro-expansions") X(macroCacheHits, "macro-cache-hits") \
+  X(rawAllocs, "raw-allocs") X(rawBytes, "raw-bytes") \
+  X(spawns, "spawns") X(commandCacheHits, "command-cache-hits") X(futures, "futures")
+typedef struct Stats
+{
+#define STATS_FIELD(field, name) uint64_t field;
+  STATS_COUNTERS(STATS_FIELD)
+#undef STATS_FIELD
+  uint64_t allocs[TAG_COUNT], allocBytes[TAG_COUNT]; // obj() by tag, bytes including the header
+} Stats;
+#ifdef TURTLE_STATS
+#define STAT(field, n) do { if (context) context->stats.field += (n); } while (0)
+#else
+#define STAT(field, n) ((void)0)
+#endif
+
+// Per-thread interpreter state. Everything else (topLevel, the symbol table) is shared:
+// global writes and interning are serialised, and global reads need no lock.
+typedef struct Context
+{
+  uintptr_t stackBase, stackLimit; // C stack guard
+  uint8_t stackOverflow;
+  Table* macroCache;
+  uint64_t macroGeneration;
+  void** stack; // VM stacks
+  struct VMFrame* frames;
+  uint64_t sp, stackCapacity, fp, frameCapacity;
+  uint64_t worker; // this thread's task queue in par.c
+  char** calls; // shadow call stack of closure names, sampled by prof.c
+  uint64_t callDepth, callCapacity;
+  Stats stats;
+  struct Context* next;
+} Context;
+extern _Thread_local Context* context;
+Context* contextInit(void* stackBase, uint64_t stackSize);
+Context* contextList();
+
+#define ARGV_INLINE 8
 void* eval(void* x, void* env);
 void* evalList(void* x, void* env);
 void* apply(void* fn, void* argList, void* env);
+void* applyArgv(void* fn, uint64_t argc, void** argv);
+void globalSet(void* const sym, void* const v);
+void macroCacheClear();
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 // obj.c ///////////////////////////////////////////////////////////////////////////////////////////
-void objInit();
+#define IMM_MASK 7
+#define IMM_FIXNUM 1
+#define IMM_NIL ((void*)2)
+#define FIXNUM_MAX 9007199254740992.0 // 2^53; every fixnum is exact as a double
+// collector settings; zero leaves the default. nursery is only used by the TURTLE_NURSERY collector
+typedef struct GcOptions { uint8_t incremental; uint64_t markers, heap, maxHeap, divisor, pauseTarget, nursery; } GcOptions;
+void objInit(const GcOptions* const o);
 void* obj(const uint8_t type, const uint64_t size);
+void* objAtomic(const uint8_t type, const uint64_t size);
+void* objAlloc(const uint64_t size);
+void* objAllocValues(const uint64_t size);
+void* objAllocAtomic(const uint64_t size);
+void objAddRoots(void* start, void* end);
+uint8_t objThread(void* (*fn)(void*), void* arg, const uint64_t stackSize);
+uint64_t objBytesAllocated(); // by the collector since startup, in every build
+#ifdef TURTLE_NURSERY
+void objPin(const void* const x); // the address of x is being hashed, so it must not move
+#else
+#define objPin(x) ((void)0)
+#endif
 uint8_t getObjTag(const void* const x);
-uint8_t objEqual(const void* const x, const void* const y);
+uint8_t objEqual(const void* x, const void* y);
+
+void* fnGcStats(uint64_t argc, void** argv);
+void* fnGcCollect(uint64_t argc, void** argv);
+void* fnGcTune(uint64_t argc, void** argv);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// out.c ///////////////////////////////////////////////////////////////////////////////////////////
+void outBegin();
+void outEnd();
+void outFlush();
+void outWrite(const char* s, const uint64_t n);
+void outChar(const char c);
+void outString(const char* s);
+void outNumber(const double n);
+void outPointer(const void* p);
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 // atom.c //////////////////////////////////////////////////////////////////////////////////////////
 char* symbol(char* str);
-double* number(double n);
-char* string(char* str);
-Cons** closure(void* argList, void* body, void* env);
+void* number(double n);
+double numberValue(const void* const x);
+String* stringBuffer(const uint64_t length);
+String* stringOf(const char* chars, const uint64_t length);
+String* string(char* str);
+String* stringWrap(char* chars, const uint64_t length);
+String* stringSlice(const String* s, const uint64_t start, const uint64_t end);
+char* stringCString(const String* s);
+Lambda* lambda(void* params, void* body);
+Closure* closure(Lambda* lambda, void* env);
 Cons** macro(void* argList, void* body);
-PrimitiveFn getPrimitiveFn(uint8_t index);
-void* setPrimitives(void* env);
+const Primitive* getPrimitive(uint8_t index);
+void setPrimitives(Table* env);
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 // cons.c //////////////////////////////////////////////////////////////////////////////////////////
@@ -50,13 +154,153 @@ uint64_t consCount(Cons* x);
 
 Cons* assocCons(void* const key, void* const v, void* const alist);
 void* assocRef(void* const key, void* alist);
-void* assocList(void* const keyList, void* const vList, void* const alist);
+void* assocList(void* keyList, void* vList, void* alist);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// table.c /////////////////////////////////////////////////////////////////////////////////////////
+Table* table(uint64_t capacity);
+Table* hashTable(uint64_t capacity);
+void* tableRef(const Table* const t, const void* const key);
+void tableSet(Table* const t, void* const key, void* const v);
+uint8_t tableDelete(Table* const t, const void* const key);
+void tableRehash(Table* const t);
+
+void* fnHashTable(uint64_t argc, void** argv);
+void* fnHashTableRef(uint64_t argc, void** argv);
+void* fnHashTableSet(uint64_t argc, void** argv);
+void* fnHashTableDelete(uint64_t argc, void** argv);
+void* fnHashTableCount(uint64_t argc, void** argv);
+void* fnHashTableToList(uint64_t argc, void** argv);
+void* fnHashTableKeys(uint64_t argc, void** argv);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// env.c ///////////////////////////////////////////////////////////////////////////////////////////
+void envInit();
+Frame* frame(void* names, void* vList, void* parent);
+Frame* frameArgs(void* names, uint64_t argc, void** argv, void* parent);
+void* envRef(void* const sym, void* env);
+void* refValue(const Ref* const r, void* env);
+void* envScope(void* env);
+uint8_t envScopeMatches(void* scope, void* env);
+void* analyseForm(void* x, void* env);
+void* analyseSeq(void* l, void* scope);
+void* analyseBody(void* params, void* body, void* env);
+void* unresolve(void* x);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// vector.c ////////////////////////////////////////////////////////////////////////////////////////
+Vector* vector(const uint64_t count, void* const fill);
+void vectorPush(Vector* const v, void* const x);
+
+void* fnVector(uint64_t argc, void** argv);
+void* fnMakeVector(uint64_t argc, void** argv);
+void* fnVectorRef(uint64_t argc, void** argv);
+void* fnVectorSet(uint64_t argc, void** argv);
+void* fnVectorLength(uint64_t argc, void** argv);
+void* fnVectorFill(uint64_t argc, void** argv);
+void* fnVectorPush(uint64_t argc, void** argv);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// str.c ///////////////////////////////////////////////////////////////////////////////////////////
+uint64_t numberFormat(char* buf, const uint64_t size, const double n);
+
+void* fnStringLength(uint64_t argc, void** argv);
+void* fnSubstring(uint64_t argc, void** argv);
+void* fnStringAppend(uint64_t argc, void** argv);
+void* fnStringJoin(uint64_t argc, void** argv);
+void* fnStringSplit(uint64_t argc, void** argv);
+void* fnStringIndex(uint64_t argc, void** argv);
+void* fnStringTrim(uint64_t argc, void** argv);
+void* fnStringToNumber(uint64_t argc, void** argv);
+void* fnNumberToString(uint64_t argc, void** argv);
+void* fnStringEq(uint64_t argc, void** argv);
+void* fnStringLt(uint64_t argc, void** argv);
+void* fnStringGt(uint64_t argc, void** argv);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// f64.c ///////////////////////////////////////////////////////////////////////////////////////////
+F64Array* f64Array(const uint64_t count);
+
+void* fnF64Array(uint64_t argc, void** argv);
+void* fnMakeF64Array(uint64_t argc, void** argv);
+void* fnListToF64Array(uint64_t argc, void** argv);
+void* fnF64ArrayToList(uint64_t argc, void** argv);
+void* fnF64ArrayRef(uint64_t argc, void** argv);
+void* fnF64ArraySet(uint64_t argc, void** argv);
+void* fnF64ArrayLength(uint64_t argc, void** argv);
+void* fnF64Add(uint64_t argc, void** argv);
+void* fnF64Sub(uint64_t argc, void** argv);
+void* fnF64Mul(uint64_t argc, void** argv);
+void* fnF64Div(uint64_t argc, void** argv);
+void* fnF64Scale(uint64_t argc, void** argv);
+void* fnF64Sum(uint64_t argc, void** argv);
+void* fnF64Dot(uint64_t argc, void** argv);
+void* fnF64Min(uint64_t argc, void** argv);
+void* fnF64Max(uint64_t argc, void** argv);
+void* fnF64PrefixSum(uint64_t argc, void** argv);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// par.c ///////////////////////////////////////////////////////////////////////////////////////////
+void* fnFuture(uint64_t argc, void** argv);
+void* fnTouch(uint64_t argc, void** argv);
+void* fnPmap(uint64_t argc, void** argv);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// stats.c /////////////////////////////////////////////////////////////////////////////////////////
+void statsInit();
+
+void* fnStats(uint64_t argc, void** argv);
+void* fnStatsReset(uint64_t argc, void** argv);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// prof.c //////////////////////////////////////////////////////////////////////////////////////////
+void lambdaName(Lambda* l, char* name);
+static inline char* lambdaNameOf(const Lambda* l) { return __atomic_load_n(&l->name, __ATOMIC_ACQUIRE); }
+void callsGrow(Context* cx);
+
+// enter a closure at depth on the shadow call stack, dropping any deeper calls
+static inline void callsSet(Context* cx, const uint64_t depth, const Lambda* l)
+{
+  if (depth >= cx->callCapacity) callsGrow(cx);
+  char* name = l ? lambdaNameOf(l) : NULL;
+  cx->calls[depth] = !l ? NULL : name ? name : "lambda"; // NULL for top-level code
+  cx->callDepth = depth + 1;
+}
+
+void* fnProfileStart(uint64_t argc, void** argv);
+void* fnProfileStop(uint64_t argc, void** argv);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// read.c //////////////////////////////////////////////////////////////////////////////////////////
+typedef struct Reader Reader;
+Reader* readerStdin();
+Reader* readerOpen(const char* path);
+void readerClose(Reader* r);
+void* readForm(Reader* r);
+uint8_t scanNumber(const char* s, const uint64_t len, double* n);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// image.c /////////////////////////////////////////////////////////////////////////////////////////
+uint8_t imageSave(const char* path);
+uint8_t imageLoad(const char* path);
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// vm.c ////////////////////////////////////////////////////////////////////////////////////////////
+void* vmEval(void* x);
+void* vmApply(Closure* c, uint64_t argc, void** argv);
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 // sys.c ///////////////////////////////////////////////////////////////////////////////////////////
-void* fnCd(void* argList, void* env);
-void* fnCwd(void* argList, void* env);
-void* fnRun(void* argList, void* env);
-void* fnDaemon(void* argList, void* env);
-void* fnPipe(void* argList, void* env);
+void jobsInit();
+void* fnCd(uint64_t argc, void** argv);
+void* fnCwd(uint64_t argc, void** argv);
+void* fnRun(uint64_t argc, void** argv);
+void* fnDaemon(uint64_t argc, void** argv);
+void* fnPipe(uint64_t argc, void** argv);
+void* fnCapture(uint64_t argc, void** argv);
+void* fnCaptureAll(uint64_t argc, void** argv);
+void* fnJobs(uint64_t argc, void** argv);
+void* fnJobWait(uint64_t argc, void** argv);
+void* fnJobKill(uint64_t argc, void** argv);
+void* fnRunParallel(uint64_t argc, void** argv);
 ////////////////////////////////////////////////////////////////////////////////////////////////////
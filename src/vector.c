@@ -0,0 +1,114 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "turtle.h"
+
+// Vector
+// Elements are stored contiguously in a separate collected block so the vector can grow
+// in place; capacity doubles on push.
+Vector* vector(const uint64_t count, void* const fill)
+{
+  Vector* v = (Vector*)obj(TAG_VECTOR, sizeof(Vector));
+  v->count = count;
+  v->capacity = count;
+  v->items = count ? objAllocValues(count * sizeof(void*)) : NULL;
+  for (uint64_t i = 0; i < count; i++) v->items[i] = fill;
+  return v;
+}
+
+void vectorPush(Vector* const v, void* const x)
+{
+  if (v->count == v->capacity)
+  {
+    v->capacity = v->capacity ? 2 * v->capacity : 8;
+    void** items = objAllocValues(v->capacity * sizeof(void*));
+    if (v->count) memcpy(items, v->items, v->count * sizeof(void*));
+    v->items = items;
+  }
+  v->items[v->count++] = x;
+}
+
+// Primitives //////////////////////////////////////////////////////////////////////////////////////
+
+// valid index into v, or -1
+static int64_t vectorIndex(const Vector* const v, const void* const i)
+{
+  if (getObjTag(i) != TAG_NUM) return -1;
+  const double n = numberValue(i);
+  return (n >= 0 && n < (double)v->count && n == (double)(uint64_t)n) ? (int64_t)n : -1;
+}
+
+void* fnVector(uint64_t argc, void** argv)
+{
+  Vector* v = vector(argc, nil);
+  if (argc) memcpy(v->items, argv, argc * sizeof(void*));
+  return v;
+}
+
+void* fnMakeVector(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: make-vector FAILED; MUST BE OF THE FORM (make-vector count [fill])";
+  if (argc < 1 || argc > 2 || getObjTag(argv[0]) != TAG_NUM) return symbol(err);
+  const double n = numberValue(argv[0]);
+  if (!(n >= 0 && n <= FIXNUM_MAX) || n != (double)(uint64_t)n) return symbol(err);
+  return vector((uint64_t)n, argc == 2 ? argv[1] : nil);
+}
+
+void* fnVectorRef(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: vector-ref FAILED; MUST BE OF THE FORM (vector-ref vector index)";
+  if (argc != 2 || getObjTag(argv[0]) != TAG_VECTOR) return symbol(err);
+  const int64_t i = vectorIndex(argv[0], argv[1]);
+  return i < 0 ? symbol("ERROR: vector-ref FAILED; INDEX OUT OF RANGE") : ((Vector*)argv[0])->items[i];
+}
+
+void* fnVectorSet(uint64_t argc, void** argv)
+{
+  char* err =  "ERROR: vector-set FAILED; MUST BE OF THE FORM (vector-set vector index expr)";
+  if (argc != 3 || getObjTag(argv[0]) != TAG_VECTOR) return symbol(err);
+  const int64_t i = vectorIndex(argv[0], argv[1]);
+  if (i < 0) return symbol("ERROR: vector-set FAILED; INDEX OUT OF RANGE");
+  ((Vector*)argv[0])->items[i] = argv[2];
+  return argv[2];
+}
+
+void* fnVectorLength(uint64_t argc, void** argv)
+{
+  if (argc != 1 || getObjTag(argv[0]) != TAG_VECTOR)
+    return symbol("ERROR: vector-length FAILED; MUST BE OF THE FORM (vector-length vector)");
+  return number((double)((Vector*)argv[0])->count);
+}
+
+void* fnVectorFill(uint64_t argc, void** argv)
+{
+  if (argc != 2 || getObjTag(argv[0]) != TAG_VECTOR)
+    return symbol("ERROR: vector-fill FAILED; MUST BE OF THE FORM (vector-fill vector expr)");
+  Vector* v = argv[0];
+  for (uint64_t i = 0; i < v->count; i++) v->items[i] = argv[1];
+  return v;
+}
+
+void* fnVectorPush(uint64_t argc, void** argv)
+{
+  if (argc != 2 || getObjTag(argv[0]) != TAG_VECTOR)
+    return symbol("ERROR: vector-push FAILED; MUST BE OF THE FORM (vector-push vector expr)");
+  vectorPush(argv[0], argv[1]);
+  return argv[0];
+}
@@ -0,0 +1,419 @@
+/*
+
+This file is part of turtle.
+Copyright (C) 2024 Taylor Wampler
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "turtle.h"
+
+// Bytecode compiler and stack VM
+// The compiler works on analysed code (see env.c), so locals are already (depth, slot)
+// pairs and environments are the same frames the tree walker uses. Closures are shared
+// between both engines; a closure body is compiled the first time the VM calls it.
+//
+// Primitives that are bound to their builtin when a form is compiled are integrated:
+// special forms become jumps and function primitives are called directly. Any other call
+// checks the callee at run time; closures get a VM frame and function primitives read
+// their arguments straight off the VM stack, while special forms and macros receive
+// their argument forms through apply as usual.
+
+enum
+{
+  OP_CONST,     // k         push consts[k]
+  OP_LOCAL,     // d s       push slot s of the frame d levels up
+  OP_GLOBAL,    // k         push the global named consts[k]
+  OP_NAME,      // k         push consts[k] looked up by name
+  OP_SETGLOBAL, // k         bind consts[k] to the top, which is replaced by consts[k]
+  OP_CLOSURE,   // k         push a closure over the lambda template consts[k]
+  OP_POP,
+  OP_JUMP,      // t
+  OP_JUMPNIL,   // t         pop, jump if nil
+  OP_ANDJUMP,   // t         jump if the top is nil, otherwise pop
+  OP_ORJUMP,    // t         jump if the top is not nil, otherwise pop
+  OP_DISPATCH,  // k t       unless the top is a closure or function primitive, replace it with apply(top, consts[k]) and jump
+  OP_APPLY,     // k         replace the top with apply(top, consts[k])
+  OP_CALL,      // n
+  OP_TAILCALL,  // n
+  OP_RETURN,
+  OP_PRIM,      // i n       call function primitive i on the top n values
+  OP_NOT
+};
+
+typedef struct Code { uint32_t* ops; void** consts; uint64_t opCount, constCount; } Code;
+
+// Compiler ////////////////////////////////////////////////////////////////////////////////////////
+typedef struct Compiler { uint32_t* ops; void** consts; uint64_t opCount, opCapacity, constCount, constCapacity; } Compiler;
+
+// alloc says what the collector may assume about the array: objAllocValues, objAllocAtomic or objAlloc
+static void* grow(void* mem, const uint64_t count, uint64_t* capacity, const uint64_t size, void* (*alloc)(const uint64_t))
+{
+  if (count < *capacity) return mem;
+  const uint64_t oldCapacity = *capacity;
+  *capacity = oldCapacity ? oldCapacity * 2 : 16;
+  void* x = alloc(*capacity * size);
+  if (oldCapacity) memcpy(x, mem, oldCapacity * size);
+  return x;
+}
+
+static uint64_t emit(Compiler* c, const uint32_t op)
+{
+  c->ops = grow(c->ops, c->opCount, &c->opCapacity, sizeof(uint32_t), objAllocAtomic);
+  c->ops[c->opCount] = op;
+  return c->opCount++;
+}
+
+static uint32_t constant(Compiler* c, void* const x)
+{
+  for (uint64_t i = 0; i < c->constCount; i++)
+    if (c->consts[i] == x) return (uint32_t)i;
+  c->consts = grow(c->consts, c->constCount, &c->constCapacity, sizeof(void*), objAllocValues);
+  c->consts[c->constCount] = x;
+  return (uint32_t)c->constCount++;
+}
+
+static void patch(Compiler* c, const uint64_t at) { c->ops[at] = (uint32_t)c->opCount; }
+
+// primitive index a global refers to right now, or -1
+static int16_t builtin(void* x)
+{
+  if (getObjTag(x) != TAG_REF || ((Ref*)x)->depth != REF_GLOBAL) return -1;
+  void* v = tableRef(topLevel, ((Ref*)x)->sym);
+  return (v && getObjTag(v) == TAG_PRIM) ? *((uint8_t*)v) : -1;
+}
+
+static void compile(Compiler* c, void* x, const uint8_t tail);
+
+static void compileSeq(Compiler* c, void* l, const uint8_t tail)
+{
+  if (getObjTag(l) != TAG_CONS) { emit(c, OP_CONST); emit(c, constant(c, nil)); return; }
+  for (; getObjTag(cdr(l)) == TAG_CONS; l = cdr(l))
+  {
+    compile(c, car(l), 0);
+    emit(c, OP_POP);
+  }
+  compile(c, car(l), tail);
+}
+
+static void compileArgs(Compiler* c, void* l) { for (; getObjTag(l) == TAG_CONS; l = cdr(l)) compile(c, car(l), 0); }
+
+static uint8_t properList(void* l)
+{
+  while (getObjTag(l) == TAG_CONS) l = cdr(l);
+  return getObjTag(l) == TAG_NIL;
+}
+
+// integrate a builtin; returns 0 when the form must go through apply instead
+static uint8_t compileBuiltin(Compiler* c, const uint8_t index, void* args, const uint8_t tail)
+{
+  const Primitive* p = getPrimitive(index);
+  char* name = p->name;
+  const uint64_t n = consCount(args);
+  if (p->fn)
+  {
+    if (!properList(args)) return 0;
+    compileArgs(c, args);
+    emit(c, OP_PRIM); emit(c, index); emit(c, (uint32_t)n);
+    return 1;
+  }
+  if (!strcmp(name, "quote") && n == 1) { emit(c, OP_CONST); emit(c, constant(c, car(args))); return 1; }
+  if (!strcmp(name, "all") && n >= 1) { compileSeq(c, args, tail); return 1; }
+  if (!strcmp(name, "global") && n == 2 && getObjTag(car(args)) == TAG_SYM)
+  {
+    compile(c, car(cdr(args)), 0);
+    emit(c, OP_SETGLOBAL); emit(c, constant(c, car(args)));
+    return 1;
+  }
+  if (!strcmp(name, "if") && n == 3)
+  {
+    compile(c, car(args), 0);
+    emit(c, OP_JUMPNIL); const uint64_t toElse = emit(c, 0);
+    compile(c, car(cdr(args)), tail);
+    emit(c, OP_JUMP); const uint64_t toEnd = emit(c, 0);
+    patch(c, toElse);
+    compile(c, car(cdr(cdr(args))), tail);
+    patch(c, toEnd);
+    return 1;
+  }
+  if ((!strcmp(name, "when") || !strcmp(name, "unless")) && n >= 2)
+  {
+    compile(c, car(args), 0);
+    if (name[0] == 'u') emit(c, OP_NOT);
+    emit(c, OP_JUMPNIL); const uint64_t toElse = emit(c, 0);
+    compileSeq(c, cdr(args), tail);
+    emit(c, OP_JUMP); const uint64_t toEnd = emit(c, 0);
+    patch(c, toElse);
+    emit(c, OP_CONST); emit(c, constant(c, nil));
+    patch(c, toEnd);
+    return 1;
+  }
+  if (!strcmp(name, "cond") && n >= 1)
+  {
+    for (void* l = args; getObjTag(l) == TAG_CONS; l = cdr(l))
+      if (consCount(car(l)) < 2) return 0;
+    uint64_t ends[n];
+    uint64_t i = 0;
+    for (void* l = args; getObjTag(l) == TAG_CONS; l = cdr(l), i++)
+    {
+      compile(c, car(car(l)), 0);
+      emit(c, OP_JUMPNIL); const uint64_t toNext = emit(c, 0);
+      compileSeq(c, cdr(car(l)), tail);
+      emit(c, OP_JUMP); ends[i] = emit(c, 0);
+      patch(c, toNext);
+    }
+    // no clause matched; the tree walker ends up evaluating (all) here
+    emit(c, OP_CONST); emit(c, constant(c, symbol("ERROR: all FAILED; MUST BE OF THE FORM (all expr ...)")));
+    for (i = 0; i < n; i++) patch(c, ends[i]);
+    return 1;
+  }
+  if ((!strcmp(name, "and") || !strcmp(name, "or")) && n >= 1)
+  {
+    const uint32_t op = name[0] == 'a' ? OP_ANDJUMP : OP_ORJUMP;
+    uint64_t ends[n];
+    uint64_t i = 0;
+    for (; getObjTag(cdr(args)) == TAG_CONS; args = cdr(args), i++)
+    {
+      compile(c, car(args), 0);
+      emit(c, op); ends[i] = emit(c, 0);
+    }
+    compile(c, car(args), 0);
+    while (i) patch(c, ends[--i]);
+    return 1;
+  }
+  return 0;
+}
+
+static void compile(Compiler* c, void* x, const uint8_t tail)
+{
+  switch (getObjTag(x))
+  {
+    case TAG_REF:
+    {
+      Ref* r = (Ref*)x;
+      if (r->depth == REF_GLOBAL) { emit(c, OP_GLOBAL); emit(c, constant(c, r->sym)); }
+      else { emit(c, OP_LOCAL); emit(c, r->depth); emit(c, r->slot); }
+      return;
+    }
+    case TAG_SYM: emit(c, OP_NAME); emit(c, constant(c, x)); return;
+    case TAG_LAMBDA: emit(c, OP_CLOSURE); emit(c, constant(c, x)); return;
+    case TAG_CONS:
+    {
+      void* head = car(x), * args = cdr(x);
+      const int16_t index = builtin(head);
+      if (index >= 0 && compileBuiltin(c, (uint8_t)index, args, tail)) return;
+
+      compile(c, head, 0);
+      if (!properList(args))
+      {
+	// dotted argument lists are spread by the tree walker
+	emit(c, OP_APPLY); emit(c, constant(c, args));
+	return;
+      }
+      emit(c, OP_DISPATCH); emit(c, constant(c, args)); const uint64_t toEnd = emit(c, 0);
+      compileArgs(c, args);
+      emit(c, tail ? OP_TAILCALL : OP_CALL); emit(c, (uint32_t)consCount(args));
+      patch(c, toEnd);
+      return;
+    }
+    default: emit(c, OP_CONST); emit(c, constant(c, x)); return;
+  }
+}
+
+static Code* compileBody(void* body)
+{
+  Compiler c = {0};
+  compileSeq(&c, body, 1);
+  emit(&c, OP_RETURN);
+  Code* code = objAlloc(sizeof(Code));
+  code->ops = c.ops;
+  code->opCount = c.opCount;
+  code->consts = c.consts;
+  code->constCount = c.constCount;
+  return code;
+}
+
+// threads may compile the same lambda at once; either result will do
+static Code* lambdaCode(Lambda* l)
+{
+  Code* code = __atomic_load_n((Code**)&l->code, __ATOMIC_ACQUIRE);
+  if (!code) __atomic_store_n((Code**)&l->code, code = compileBody(l->body), __ATOMIC_RELEASE);
+  return code;
+}
+
+// VM //////////////////////////////////////////////////////////////////////////////////////////////
+typedef struct VMFrame { Code* code; void* env; uint64_t pc, base; } VMFrame;
+
+// both stacks belong to the thread's context and live in collected memory so the values
+// on them stay reachable
+static void push(Context* cx, void* x)
+{
+  cx->stack = grow(cx->stack, cx->sp, &cx->stackCapacity, sizeof(void*), objAllocValues);
+  cx->stack[cx->sp++] = x;
+}
+
+// each frame also holds a slot on the shadow call stack, empty for top-level code
+static void pushFrame(Context* cx, Code* code, void* env, const Lambda* l)
+{
+  cx->frames = grow(cx->frames, cx->fp, &cx->frameCapacity, sizeof(VMFrame), objAlloc);
+  cx->frames[cx->fp++] = (VMFrame){code, env, 0, cx->sp};
+  callsSet(cx, cx->callDepth, l);
+}
+
+static void* run(Code* code, void* env, const Lambda* l)
+{
+  Context* cx = context;
+  const uint64_t fp0 = cx->fp, depth = cx->callDepth;
+  pushFrame(cx, code, env, l);
+  VMFrame* f = &cx->frames[cx->fp - 1];
+  uint32_t* ops = code->ops;
+  void** k = code->consts;
+  while (1)
+  {
+    STAT(vmInstructions, 1);
+    switch (ops[f->pc++])
+    {
+      case OP_CONST: push(cx, k[ops[f->pc++]]); break;
+      case OP_LOCAL:
+      {
+	Frame* e = f->env;
+	STAT(lookups, 1);
+	STAT(lookupDepth, ops[f->pc]);
+	for (uint32_t d = ops[f->pc++]; d; d--) e = e->parent;
+	push(cx, e->slots[ops[f->pc++]]);
+	break;
+      }
+      case OP_GLOBAL:
+      {
+	STAT(lookups, 1);
+	STAT(globalLookups, 1);
+	void* x = tableRef(topLevel, k[ops[f->pc++]]);
+	push(cx, x ? x : symbol("ERROR: ASSOC REF FAILED"));
+	break;
+      }
+      case OP_NAME: push(cx, envRef(k[ops[f->pc++]], f->env)); break;
+      case OP_SETGLOBAL:
+      {
+	void* sym = k[ops[f->pc++]];
+	globalSet(sym, cx->stack[cx->sp - 1]);
+	cx->stack[cx->sp - 1] = sym;
+	break;
+      }
+      case OP_CLOSURE: push(cx, closure(k[ops[f->pc++]], f->env)); break;
+      case OP_POP: cx->sp--; break;
+      case OP_JUMP: f->pc = ops[f->pc]; break;
+      case OP_JUMPNIL:
+	if (getObjTag(cx->stack[--cx->sp]) == TAG_NIL) f->pc = ops[f->pc]; else f->pc++;
+	break;
+      case OP_ANDJUMP:
+	if (getObjTag(cx->stack[cx->sp - 1]) == TAG_NIL) f->pc = ops[f->pc]; else { cx->sp--; f->pc++; }
+	break;
+      case OP_ORJUMP:
+	if (getObjTag(cx->stack[cx->sp - 1]) != TAG_NIL) f->pc = ops[f->pc]; else { cx->sp--; f->pc++; }
+	break;
+      case OP_DISPATCH:
+      {
+	void* fn = cx->stack[cx->sp - 1];
+	void* args = k[ops[f->pc++]];
+	if (getObjTag(fn) == TAG_CLSR || (getObjTag(fn) == TAG_PRIM && getPrimitive(*((uint8_t*)fn))->fn))
+	{
+	  f->pc++;
+	  break;
+	}
+	void* x = apply(fn, args, f->env);
+	// apply may have re-entered the VM and moved the stacks
+	f = &cx->frames[cx->fp - 1];
+	cx->stack[cx->sp - 1] = x;
+	f->pc = ops[f->pc];
+	break;
+      }
+      case OP_APPLY:
+      {
+	void* x = apply(cx->stack[cx->sp - 1], k[ops[f->pc++]], f->env);
+	f = &cx->frames[cx->fp - 1];
+	cx->stack[cx->sp - 1] = x;
+	break;
+      }
+      case OP_CALL: case OP_TAILCALL:
+      {
+	STAT(calls, 1);
+	const uint8_t tail = ops[f->pc - 1] == OP_TAILCALL;
+	const uint64_t argc = ops[f->pc++];
+	if (getObjTag(cx->stack[cx->sp - argc - 1]) == TAG_PRIM)
+	{
+	  void* x = getPrimitive(*((uint8_t*)cx->stack[cx->sp - argc - 1]))->fn(argc, &cx->stack[cx->sp - argc]);
+	  // pmap, touch and futures run inline re-enter the VM, which may move the frames
+	  f = &cx->frames[cx->fp - 1];
+	  ops = f->code->ops;
+	  k = f->code->consts;
+	  cx->sp -= argc;
+	  cx->stack[cx->sp - 1] = x;
+	  if (tail) goto ret;
+	  break;
+	}
+	Closure* fn = cx->stack[cx->sp - argc - 1];
+	Frame* e = frameArgs(fn->lambda->params, argc, &cx->stack[cx->sp - argc], fn->env);
+	Code* callee = lambdaCode(fn->lambda);
+	cx->sp -= argc + 1;
+	if (tail)
+	{
+	  cx->sp = f->base;
+	  *f = (VMFrame){callee, e, 0, cx->sp};
+	  callsSet(cx, cx->callDepth - 1, fn->lambda);
+	}
+	else { pushFrame(cx, callee, e, fn->lambda); f = &cx->frames[cx->fp - 1]; }
+	ops = callee->ops;
+	k = callee->consts;
+	break;
+      }
+      case OP_RETURN:
+      ret:
+      {
+	void* x = cx->stack[cx->sp - 1];
+	cx->sp = f->base;
+	cx->callDepth--;
+	if (--cx->fp == fp0)
+	{
+	  cx->callDepth = depth;
+	  return x;
+	}
+	f = &cx->frames[cx->fp - 1];
+	ops = f->code->ops;
+	k = f->code->consts;
+	push(cx, x);
+	break;
+      }
+      case OP_PRIM:
+      {
+	STAT(calls, 1);
+	const PrimitiveFn fn = getPrimitive(ops[f->pc++])->fn;
+	const uint64_t argc = ops[f->pc++];
+	void* x = fn(argc, &cx->stack[cx->sp - argc]);
+	f = &cx->frames[cx->fp - 1];
+	ops = f->code->ops;
+	k = f->code->consts;
+	cx->sp -= argc;
+	push(cx, x);
+	break;
+      }
+      case OP_NOT: cx->stack[cx->sp - 1] = getObjTag(cx->stack[cx->sp - 1]) == TAG_NIL ? truth : nil; break;
+      default: panic("run(): invalid opcode");
+    }
+  }
+}
+
+void* vmEval(void* x) { return run(compileBody(cons(analyseForm(x, nil), nil)), nil, NULL); }
+
+void* vmApply(Closure* c, uint64_t argc, void** argv) { return run(lambdaCode(c->lambda), frameArgs(c->lambda->params, argc, argv, c->env), c->lambda); }